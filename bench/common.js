@@ -0,0 +1,49 @@
+'use strict';
+// shared by the bench/ cases: picks the transport under test, parses
+// --key=value flags and prints a case's result as one line of JSON
+
+const net = require('net');
+
+const args = {};
+for (const arg of process.argv.slice(2)) {
+    const m = /^--([^=]+)(?:=(.*))?$/.exec(arg);
+    if (m) args[m[1]] = m[2] === undefined ? true : m[2];
+}
+
+exports.args = args;
+
+exports.number = function (name, dflt) {
+    const value = parseFloat(args[name]);
+    return isNaN(value) ? dflt : value;
+};
+
+// utp and net share createServer(options, listener) and
+// connect({ port, host }, listener), which is all the cases use
+exports.transport = function () {
+    const name = args.transport || 'utp';
+    if (name === 'tcp') return { name: name, createServer: net.createServer, connect: net.connect };
+    if (name === 'utp') {
+        const utp = require('..');
+        return { name: name, createServer: utp.createServer, connect: utp.connect };
+    }
+    throw new Error('unknown transport ' + name);
+};
+
+exports.HOST = '127.0.0.1';
+
+exports.now = function () {
+    const t = process.hrtime();
+    return t[0] + t[1] / 1e9;
+};
+
+// cpu seconds this process used since start, both sides of the connection
+// included as they share the process
+exports.cpuSince = function (start) {
+    const used = process.cpuUsage(start);
+    return (used.user + used.system) / 1e6;
+};
+
+exports.report = function (result) {
+    console.log(JSON.stringify(result));
+    process.exit(0);
+};
@@ -0,0 +1,62 @@
+'use strict';
+// how fast connections are set up and torn down over loopback, with a
+// number of handshakes in flight at once:
+//   node bench/connect.js [--transport=utp|tcp] [--connections=2000]
+//                         [--concurrency=50]
+
+const common = require('./common');
+
+const transport = common.transport();
+const connections = common.number('connections', 2000);
+const concurrency = common.number('concurrency', 50);
+
+let started = 0, connected = 0, failed = 0;
+let start, cpu;
+
+const server = transport.createServer({}, socket => {
+    socket.on('error', () => {});
+    socket.resume();
+    socket.end();
+});
+
+function done() {
+    const secs = common.now() - start;
+    common.report({
+        bench: 'connect',
+        transport: transport.name,
+        connections: connected,
+        failed: failed,
+        concurrency: concurrency,
+        seconds: secs,
+        connectionsPerSecond: connected / secs,
+        cpuSeconds: common.cpuSince(cpu)
+    });
+}
+
+function next(port) {
+    if (started >= connections) {
+        if (connected + failed === connections) done();
+        return;
+    }
+    started++;
+    let settled = false;
+    const client = transport.connect({ port: port, host: common.HOST }, () => {
+        settled = true;
+        connected++;
+        client.destroy();
+        next(port);
+    });
+    client.on('error', () => {
+        if (settled) return;
+        settled = true;
+        failed++;
+        next(port);
+    });
+}
+
+server.listen(0, common.HOST, () => {
+    const port = server.address().port;
+    start = common.now();
+    cpu = process.cpuUsage();
+    for (let i = 0; i < concurrency; i++) next(port);
+});
@@ -0,0 +1,103 @@
+'use strict';
+// request/response round trips over loopback, one request in flight per
+// connection:
+//   node bench/latency.js [--transport=utp|tcp] [--size=64] [--requests=10000]
+//                         [--connections=1]
+
+const common = require('./common');
+
+const transport = common.transport();
+const size = common.number('size', 64);
+const requests = common.number('requests', 10000);
+const connections = common.number('connections', 1);
+
+const PERCENTILES = [50, 90, 99, 99.9];
+
+// echoes every full request back
+const server = transport.createServer({}, socket => {
+    noDelay(socket);
+    let pending = 0;
+    socket.on('data', buf => {
+        pending += buf.length;
+        while (pending >= size) {
+            pending -= size;
+            socket.write(Buffer.alloc(size));
+        }
+    });
+    socket.on('error', () => {});
+});
+
+// nagle would hold back small requests over tcp; utp has nothing of the kind
+function noDelay(socket) {
+    if (socket.setNoDelay) socket.setNoDelay(true);
+}
+
+const samples = [];
+let started = 0, finished = 0;
+let start, cpu;
+
+function run(client) {
+    let sent, pending = 0;
+    const request = Buffer.alloc(size, 0x61);
+    function next() {
+        if (started >= requests) {
+            if (++finished === connections) done();
+            return;
+        }
+        started++;
+        sent = process.hrtime();
+        client.write(request);
+    }
+    client.on('data', buf => {
+        pending += buf.length;
+        if (pending < size) return;
+        pending -= size;
+        const rtt = process.hrtime(sent);
+        samples.push(rtt[0] * 1e6 + rtt[1] / 1e3);
+        next();
+    });
+    next();
+}
+
+function percentile(sorted, p) {
+    if (!sorted.length) return null;
+    return sorted[Math.min(sorted.length - 1, Math.ceil(sorted.length * p / 100) - 1)];
+}
+
+function done() {
+    const secs = common.now() - start;
+    const sorted = samples.slice().sort((a, b) => a - b);
+    const us = {};
+    for (const p of PERCENTILES) us['p' + p] = percentile(sorted, p);
+    us.min = sorted[0];
+    us.max = sorted[sorted.length - 1];
+    us.mean = sorted.reduce((a, b) => a + b, 0) / sorted.length;
+    common.report({
+        bench: 'latency',
+        transport: transport.name,
+        size: size,
+        connections: connections,
+        requests: samples.length,
+        seconds: secs,
+        requestsPerSecond: samples.length / secs,
+        cpuSeconds: common.cpuSince(cpu),
+        us: us
+    });
+}
+
+server.listen(0, common.HOST, () => {
+    const port = server.address().port;
+    let connected = 0;
+    const clients = [];
+    for (let i = 0; i < connections; i++) {
+        const client = transport.connect({ port: port, host: common.HOST }, () => {
+            if (++connected < connections) return;
+            start = common.now();
+            cpu = process.cpuUsage();
+            clients.forEach(run);
+        });
+        client.on('error', () => {});
+        noDelay(client);
+        clients.push(client);
+    }
+});
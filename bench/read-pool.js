@@ -0,0 +1,96 @@
+'use strict';
+// sustained download over loopback, reporting allocation with and without
+// the read pool. --idle opens that many connections first that each send a
+// few bytes and then sit idle; idlePool shows the blocks they leave behind:
+//   node --expose-gc bench/read-pool.js [seconds] [--no-pool] [--release] [--idle=N]
+
+const utp = require('..');
+
+const args = process.argv.slice(2);
+const seconds = parseFloat(args.find(a => !a.startsWith('--'))) || 10;
+const pool = args.indexOf('--no-pool') < 0;
+const release = args.indexOf('--release') >= 0;
+const idleArg = args.find(a => a.startsWith('--idle='));
+const idle = idleArg ? parseInt(idleArg.slice(7), 10) : 0;
+
+const block = Buffer.alloc(65536, 0x61);
+let received = 0, chunks = 0, greeted = 0, idlePool = null;
+let onGreeted = () => {};
+const idleClients = [];
+
+const server = utp.createServer({ readPool: pool, maxConnections: 0 }, socket => {
+    let first = true;
+    socket.on('data', buf => {
+        if (first && buf.toString() === 'hello') {
+            // an idle connection saying hello, the bulk one never does
+            first = false;
+            if (release) utp.releaseBuffer(buf);
+            if (++greeted === idle) onGreeted();
+            return;
+        }
+        first = false;
+        received += buf.length;
+        chunks++;
+        if (release) utp.releaseBuffer(buf);
+    });
+    socket.on('error', () => {});
+});
+
+server.listen(0, '127.0.0.1', () => {
+    if (!idle) return bulk();
+    onGreeted = () => {
+        // whatever the idle connections still hold once their data is gone
+        if (global.gc) global.gc();
+        setTimeout(() => {
+            if (global.gc) global.gc();
+            idlePool = utp.readPoolStats();
+            bulk();
+        }, 100);
+    };
+    for (let i = 0; i < idle; i++) {
+        const c = utp.connect({ port: server.address().port, host: '127.0.0.1' }, () => c.write('hello'));
+        c.on('error', () => {});
+        idleClients.push(c);
+    }
+});
+
+function bulk() {
+    const client = utp.connect({ port: server.address().port, host: '127.0.0.1' });
+    client.on('error', () => {});
+    (function send() {
+        while (client.write(block));
+        client.once('drain', send);
+    })();
+
+    if (global.gc) global.gc();
+    const before = process.memoryUsage();
+    const start = process.hrtime();
+    let peakRss = before.rss, peakExternal = before.external;
+    const sampler = setInterval(() => {
+        const mem = process.memoryUsage();
+        peakRss = Math.max(peakRss, mem.rss);
+        peakExternal = Math.max(peakExternal, mem.external);
+    }, 100);
+
+    setTimeout(() => {
+        clearInterval(sampler);
+        const elapsed = process.hrtime(start);
+        const secs = elapsed[0] + elapsed[1] / 1e9;
+        const after = process.memoryUsage();
+        console.log(JSON.stringify({
+            pool: pool,
+            release: release,
+            seconds: secs,
+            bytes: received,
+            chunks: chunks,
+            mbps: received * 8 / secs / 1e6,
+            rssGrowth: peakRss - before.rss,
+            peakExternal: peakExternal,
+            heapUsedDelta: after.heapUsed - before.heapUsed,
+            idle: idle,
+            idlePool: idlePool,
+            readPool: utp.readPoolStats()
+        }, null, 2));
+        process.exit(0);
+    }, seconds * 1000);
+}
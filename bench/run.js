@@ -0,0 +1,56 @@
+'use strict';
+// runs every case against utp and against tcp as the reference, each in a
+// process of its own, and prints the results as a JSON array:
+//   node bench/run.js [--seconds=10] [--transport=utp|tcp] [--only=name]
+//                     [--out=results.json]
+
+const childProcess = require('child_process');
+const fs = require('fs');
+const path = require('path');
+const common = require('./common');
+
+const seconds = common.number('seconds', 10);
+
+const cases = [
+    { name: 'throughput', file: 'throughput.js', args: ['--streams=1', '--seconds=' + seconds] },
+    { name: 'throughput-multi', file: 'throughput.js', args: ['--streams=16', '--seconds=' + seconds] },
+    { name: 'latency', file: 'latency.js', args: ['--size=64', '--requests=10000'] },
+    { name: 'latency-concurrent', file: 'latency.js', args: ['--size=1024', '--requests=20000', '--connections=16'] },
+    { name: 'connect', file: 'connect.js', args: ['--connections=2000', '--concurrency=50'] },
+];
+
+const transports = common.args.transport ? [common.args.transport] : ['utp', 'tcp'];
+
+const results = [];
+for (const c of cases) {
+    if (common.args.only && common.args.only !== c.name) continue;
+    for (const transport of transports) {
+        const args = [path.join(__dirname, c.file), '--transport=' + transport].concat(c.args);
+        process.stderr.write(c.name + ' ' + transport + '... ');
+        const child = childProcess.spawnSync(process.execPath, args, {
+            encoding: 'utf8',
+            stdio: ['ignore', 'pipe', 'inherit'],
+            timeout: (seconds + 60) * 1000
+        });
+        const line = (child.stdout || '').trim().split('\n').pop();
+        let result;
+        try {
+            result = JSON.parse(line);
+        } catch (err) {
+            result = { bench: c.name, transport: transport, error: child.error ? child.error.message : 'exit ' + child.status };
+        }
+        result.case = c.name;
+        results.push(result);
+        process.stderr.write((result.error || 'done') + '\n');
+    }
+}
+
+const output = JSON.stringify({
+    node: process.version,
+    platform: process.platform,
+    arch: process.arch,
+    date: new Date().toISOString(),
+    results: results
+}, null, 2);
+if (typeof common.args.out === 'string') fs.writeFileSync(common.args.out, output + '\n');
+else console.log(output);
@@ -0,0 +1,51 @@
+'use strict';
+// bulk transfer over loopback on one or more streams at once:
+//   node bench/throughput.js [--transport=utp|tcp] [--streams=1] [--seconds=10]
+
+const common = require('./common');
+
+const transport = common.transport();
+const streams = common.number('streams', 1);
+const seconds = common.number('seconds', 10);
+
+const block = Buffer.alloc(65536, 0x61);
+let received = 0;
+
+const server = transport.createServer({}, socket => {
+    socket.on('data', buf => { received += buf.length; });
+    socket.on('error', () => {});
+});
+
+server.listen(0, common.HOST, () => {
+    const port = server.address().port;
+    for (let i = 0; i < streams; i++) {
+        const client = transport.connect({ port: port, host: common.HOST });
+        client.on('error', () => {});
+        (function send() {
+            while (client.write(block));
+            client.once('drain', send);
+        })();
+    }
+
+    // leave out the slow start of the first second
+    setTimeout(() => {
+        const base = received;
+        const start = common.now();
+        const cpu = process.cpuUsage();
+        setTimeout(() => {
+            const secs = common.now() - start;
+            const bytes = received - base;
+            const cpuSecs = common.cpuSince(cpu);
+            common.report({
+                bench: streams > 1 ? 'throughput-multi' : 'throughput',
+                transport: transport.name,
+                streams: streams,
+                seconds: secs,
+                bytes: bytes,
+                mbps: bytes * 8 / secs / 1e6,
+                cpuSeconds: cpuSecs,
+                cpuSecondsPerGB: bytes ? cpuSecs * 1e9 / bytes : null
+            });
+        }, seconds * 1000);
+    }, 1000);
+});
@@ -12,11 +12,10 @@
 			"sources": [
 				'src/utp_context.cc',
 				'src/utp_socket.cc',
+				'src/utp_pool.cc',
+				'src/utp_timer.cc',
 				'src/utp.cc'
 			],
-			'defines':[
-				'UTP_DEBUG_LOGGING'
-			],
 			'conditions': [
 				['OS=="win"', {
 					'libraries': [
@@ -39,9 +38,6 @@
 		{
 			'target_name': 'libutp',
 			'type': 'static_library',
-			'defines': [
-			    'UTP_DEBUG_LOGGING'
-			],
 			'sources': [
 				'deps/libutp/utp_callbacks.cpp',
 				'deps/libutp/utp_internal.cpp',
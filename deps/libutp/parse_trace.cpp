@@ -0,0 +1,275 @@
+// Reads a binary trace (utp_trace_record after utp_trace_record, as drained
+// from a utp_trace_ring) and produces what parse_log.py produces from a text
+// log: utp.out<socket> with one line per congestion control update,
+// utp.out<socket>.histogram with our delay samples and utp.gnuplot to plot
+// them.
+//
+// usage: parse_trace trace-file [socket id to focus on] [-p to run gnuplot]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "utp.h"
+
+// records read from the file at once
+#define BATCH 65536
+
+struct Metric {
+	const char *name;
+	const char *title;
+	const char *axes;
+	const char *style;
+};
+
+static const char *delay_samples = "dots lc rgb \"blue\"";
+static const char *delay_base = "steps lw 2 lc rgb \"purple\"";
+static const char *target_delay = "steps lw 2 lc rgb \"red\"";
+static const char *off_target = "dots lc rgb \"blue\"";
+static const char *cwnd = "steps lc rgb \"green\"";
+static const char *window_size = "steps lc rgb \"sea-green\"";
+static const char *rtt = "lines lc rgb \"light-blue\"";
+
+// the columns of the output, in order
+static const Metric metrics[] = {
+	{ "our_delay", "our delay (ms)", "x1y2", delay_samples },
+	{ "upload_rate", "send rate (B/s)", "x1y1", "lines" },
+	{ "max_window", "cwnd (B)", "x1y1", cwnd },
+	{ "target_delay", "target delay (ms)", "x1y2", target_delay },
+	{ "cur_window", "bytes in-flight (B)", "x1y1", window_size },
+	{ "cur_window_packets", "number of packets in-flight", "x1y2", "steps" },
+	{ "packet_size", "current packet size (B)", "x1y2", "steps" },
+	{ "rtt", "rtt (ms)", "x1y2", rtt },
+	{ "off_target", "off-target (ms)", "x1y2", off_target },
+	{ "delay_sum", "delay sum (ms)", "x1y2", "steps" },
+	{ "their_delay", "their delay (ms)", "x1y2", delay_samples },
+	{ "get_microseconds", "clock (us)", "x1y1", "steps" },
+	{ "wnduser", "advertised window size (B)", "x1y1", "steps" },
+	{ "delay_base", "delay base (us)", "x1y1", delay_base },
+	{ "actual_delay", "actual_delay (us)", "x1y1", delay_samples },
+};
+static const int num_metrics = sizeof(metrics) / sizeof(metrics[0]);
+
+struct Plot {
+	const char *title;
+	const char *y1;
+	const char *y2;
+	const char *data[8];
+};
+
+// parse_log.py's plots, less the ones on their delay base which the trace
+// does not carry
+static const Plot plots[] = {
+	{ "send-packet-size", "Bytes", "Time (ms)",
+		{ "upload_rate", "max_window", "cur_window", "wnduser", "cur_window_packets", "packet_size", "rtt", NULL } },
+	{ "uploading", "Bytes", "Time (ms)",
+		{ "our_delay", "max_window", "target_delay", "cur_window", "wnduser", "cur_window_packets", NULL } },
+	{ "uploading_packets", "Bytes", "Time (ms)",
+		{ "our_delay", "max_window", "target_delay", "cur_window", "cur_window_packets", NULL } },
+	{ "timer", "Time microseconds", "Time (ms)",
+		{ "get_microseconds", NULL } },
+	{ "their_delay", "", "Time (ms)",
+		{ "their_delay", "target_delay", "rtt", NULL } },
+	{ "our-delay", "", "Time (ms)",
+		{ "our_delay", "target_delay", "rtt", NULL } },
+	{ "our_delay_base", "Time (us)", "",
+		{ "actual_delay", "delay_base", NULL } },
+};
+
+static int metric_index(const char *name)
+{
+	for (int i = 0; i < num_metrics; i++) {
+		if (strcmp(metrics[i].name, name) == 0) return i;
+	}
+	return -1;
+}
+
+// calls f for every record in the file
+template <typename F> static void scan(const char *path, F f)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	std::vector<utp_trace_record> batch(BATCH);
+	size_t n;
+	while ((n = fread(&batch[0], sizeof(utp_trace_record), BATCH, file)) > 0) {
+		for (size_t i = 0; i < n; i++) f(batch[i]);
+	}
+	fclose(file);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = NULL;
+	bool have_filter = false;
+	uint32 socket_filter = 0;
+	bool run_gnuplot = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-p") == 0) run_gnuplot = true;
+		else if (!path) path = argv[i];
+		else {
+			have_filter = true;
+			socket_filter = strtoul(argv[i], NULL, 0);
+		}
+	}
+	if (!path) {
+		fprintf(stderr, "usage: %s trace-file [socket id to focus on] [-p]\n", argv[0]);
+		return 1;
+	}
+
+	if (!have_filter) {
+		printf("scanning for socket with the most packets\n");
+		std::map<uint32, uint64> sockets;
+		scan(path, [&](const utp_trace_record &r) {
+			if (r.type == UTP_TRACE_CCONTROL) sockets[r.socket]++;
+		});
+		if (sockets.empty()) {
+			fprintf(stderr, "no congestion control records in %s\n", path);
+			return 1;
+		}
+		std::vector<std::pair<uint32, uint64> > items(sockets.begin(), sockets.end());
+		std::sort(items.begin(), items.end(), [](const std::pair<uint32, uint64> &a, const std::pair<uint32, uint64> &b) {
+			return a.second > b.second;
+		});
+		for (size_t i = 0; i < items.size() && i < 6; i++) {
+			printf("%u: %llu\n", items[i].first, (unsigned long long)items[i].second);
+		}
+		socket_filter = items[0].first;
+		printf("\nfocusing on socket %u\n", socket_filter);
+	}
+
+	char out_file[64];
+	snprintf(out_file, sizeof(out_file), "utp.out%u", socket_filter);
+	FILE *out = fopen(out_file, "wb");
+	if (!out) {
+		perror(out_file);
+		return 1;
+	}
+
+	printf("reading trace file\n");
+
+	uint64 begin = 0;
+	bool have_begin = false;
+	uint64 counter = 0;
+	uint64 packet_loss = 0, packet_timeout = 0;
+	std::map<uint32, uint64> delay_histogram;
+
+	scan(path, [&](const utp_trace_record &r) {
+		if (r.socket != socket_filter) return;
+		counter++;
+		if (r.type == UTP_TRACE_LOSS) {
+			packet_loss++;
+			return;
+		}
+		if (r.type == UTP_TRACE_TIMEOUT) {
+			packet_timeout++;
+			return;
+		}
+		if (r.type != UTP_TRACE_CCONTROL) return;
+
+		if (!have_begin) {
+			begin = r.time;
+			have_begin = true;
+		}
+		delay_histogram[r.our_delay / 1000]++;
+
+		const double our_delay = r.our_delay / 1000.;
+		const double target = r.target_delay / 1000.;
+		const double values[] = {
+			our_delay,
+			(double)r.max_window * 1000 / (r.rtt ? r.rtt : 50),
+			(double)r.max_window,
+			target,
+			(double)r.cur_window,
+			(double)r.cur_window_packets,
+			(double)r.packet_size,
+			(double)r.rtt,
+			target - our_delay,
+			our_delay + r.their_delay / 1000.,
+			r.their_delay / 1000.,
+			(double)r.time,
+			(double)r.peer_window,
+			(double)r.delay_base,
+			(double)r.actual_delay,
+		};
+		fprintf(out, "%f\t", (r.time - begin) / 1000000.);
+		for (int i = 0; i < num_metrics; i++) fprintf(out, "%f\t", values[i]);
+		fprintf(out, "%f %f\n", (double)(packet_loss * 8000), (double)(packet_timeout * 8000));
+		packet_loss = 0;
+		packet_timeout = 0;
+	});
+	fclose(out);
+	printf("%llu records for socket %u\n", (unsigned long long)counter, socket_filter);
+
+	std::string histogram_file = std::string(out_file) + ".histogram";
+	out = fopen(histogram_file.c_str(), "wb");
+	if (!out) {
+		perror(histogram_file.c_str());
+		return 1;
+	}
+	for (std::map<uint32, uint64>::iterator it = delay_histogram.begin(); it != delay_histogram.end(); ++it) {
+		fprintf(out, "%f %llu\n", it->first + 0.5, (unsigned long long)it->second);
+	}
+	fclose(out);
+
+	out = fopen("utp.gnuplot", "w+");
+	if (!out) {
+		perror("utp.gnuplot");
+		return 1;
+	}
+	std::string files;
+	fprintf(out, "set term png size 1280,800\n");
+	fprintf(out, "set output \"%s.delays.png\"\n", out_file);
+	fprintf(out, "set xrange [0:250]\n");
+	fprintf(out, "set xlabel \"delay (ms)\"\n");
+	fprintf(out, "set boxwidth 1\n");
+	fprintf(out, "set style fill solid\n");
+	fprintf(out, "set ylabel \"number of packets\"\n");
+	fprintf(out, "plot \"%s.histogram\" using 1:2 with boxes\n", out_file);
+	fprintf(out, "set style data steps\n");
+	fprintf(out, "set y2range [*:*]\n");
+	files += std::string(out_file) + ".delays.png ";
+
+	for (size_t p = 0; p < sizeof(plots) / sizeof(plots[0]); p++) {
+		const Plot &plot = plots[p];
+		fprintf(out, "set title \"%s socket: %u\"\n", plot.title, socket_filter);
+		fprintf(out, "set xlabel \"time (s)\"\n");
+		fprintf(out, "set ylabel \"%s\"\n", plot.y1);
+		fprintf(out, "set tics nomirror\n");
+		fprintf(out, "set y2tics\n");
+		fprintf(out, "set y2label \"%s\"\n", plot.y2);
+		fprintf(out, "set xrange [0:*]\n");
+		fprintf(out, "set key box\n");
+		fprintf(out, "set term png size 1280,800\n");
+		fprintf(out, "set output \"%s-%s.png\"\n", out_file, plot.title);
+		files += std::string(out_file) + "-" + plot.title + ".png ";
+
+		const char *comma = "";
+		fprintf(out, "plot ");
+		for (int d = 0; plot.data[d]; d++) {
+			const int i = metric_index(plot.data[d]);
+			if (i < 0) continue;
+			const Metric &m = metrics[i];
+			fprintf(out, "%s\"%s\" using 1:%d title \"%s-%s\" axes %s with %s",
+				comma, out_file, i + 2, m.title, m.axes, m.axes, m.style);
+			comma = ", ";
+		}
+		fprintf(out, "\n");
+	}
+	fclose(out);
+
+	if (run_gnuplot) {
+		if (system("gnuplot utp.gnuplot") != 0) return 1;
+		printf("%s\n", files.c_str());
+	} else {
+		printf("run gnuplot utp.gnuplot to get %s\n", files.c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,310 @@
+// Microbenchmarks of libutp's core data structures, in nanoseconds per
+// operation. utp_internal.cpp is compiled into this file so its internals
+// (UTPSocket, SizableCircularBuffer, DelayHist) can be driven directly; link
+// against every other object of the library.
+//
+// usage: ubench [name filter] [-t seconds per benchmark]
+
+#include "utp_internal.cpp"
+
+#include <time.h>
+#include <deque>
+#include <vector>
+#include <string>
+
+// at least this long per benchmark
+static double min_seconds = 0.2;
+static const char *filter = NULL;
+
+static uint64 now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// keeps the compiler from dropping a result nobody reads
+template <typename T> static inline void keep(const T &value)
+{
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// runs f(iterations) with growing iteration counts until it takes
+// min_seconds, then prints the time per iteration
+template <typename F> static void run(const char *name, F f)
+{
+	if (filter && !strstr(name, filter)) return;
+	uint64 iterations = 1;
+	for (;;) {
+		const uint64 start = now_ns();
+		f(iterations);
+		const uint64 elapsed = now_ns() - start;
+		if (elapsed >= min_seconds * 1e9) {
+			printf("%-32s %12.2f ns/op %12llu ops\n", name, (double)elapsed / iterations, (unsigned long long)iterations);
+			return;
+		}
+		// aim a little past min_seconds, at most 100x more per round
+		const double per = elapsed ? (double)elapsed / iterations : 1;
+		uint64 next = (uint64)(min_seconds * 1.2e9 / per);
+		iterations = max<uint64>(iterations + 1, min<uint64>(next, iterations * 100));
+	}
+}
+
+static PackedSockAddr address(uint32 ip, uint16 port)
+{
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(ip);
+	sin.sin_port = htons(port);
+	return PackedSockAddr((const SOCKADDR_STORAGE*)&sin, sizeof(sin));
+}
+
+typedef utpHashTable<UTPSocketKey, UTPSocketKeyData> KeyTable;
+
+static void bench_hash_table()
+{
+	const int n = 1000;
+	std::vector<UTPSocketKey> keys, missing;
+	for (int i = 0; i < n; i++) {
+		keys.push_back(UTPSocketKey(address(0x0a000000 + i, 6881), i * 7919));
+		missing.push_back(UTPSocketKey(address(0x0b000000 + i, 6881), i * 7919));
+	}
+	KeyTable table;
+	table.Init();
+	table.Create(UTP_SOCKET_BUCKETS, UTP_SOCKET_INIT);
+	for (int i = 0; i < n; i++) table.Add(keys[i])->socket = NULL;
+
+	run("hash_table/lookup_hit", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) keep(table.Lookup(keys[i % n]));
+	});
+	run("hash_table/lookup_miss", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) keep(table.Lookup(missing[i % n]));
+	});
+	run("hash_table/add_delete", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) {
+			const UTPSocketKey &key = missing[i % n];
+			table.Add(key)->socket = NULL;
+			keep(table.Delete(key));
+		}
+	});
+	table.Free();
+}
+
+static void bench_sockaddr()
+{
+	const PackedSockAddr a = address(0x7f000001, 6881);
+	const PackedSockAddr b = address(0x7f000001, 6881);
+	const PackedSockAddr c = address(0x7f000001, 6882);
+	run("packed_sockaddr/equal", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) {
+			keep(a == b);
+			keep(a == c);
+		}
+	});
+	run("packed_sockaddr/compute_hash", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) {
+			keep(&a);
+			keep(a.compute_hash());
+		}
+	});
+
+	byte key[sizeof(UTPSocketKey)];
+	memset(key, 0x5a, sizeof(key));
+	run("utp_hash_mem/socket_key", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) {
+			keep(key);
+			keep(utp_hash_mem(key, sizeof(key)));
+		}
+	});
+}
+
+static void bench_circular_buffer()
+{
+	// as outbuf does while the window opens: from 16 entries to 1024
+	run("circular_buffer/grow_16_to_1024", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) {
+			SizableCircularBuffer buf;
+			buf.mask = 15;
+			buf.elements = (void**)calloc(16, sizeof(void*));
+			for (size_t n = 1; n < 1024; n++) {
+				buf.ensure_size(n, n);
+				buf.put(n, &buf);
+			}
+			keep(buf.elements);
+			free(buf.elements);
+		}
+	});
+
+	SizableCircularBuffer buf;
+	buf.mask = 1023;
+	buf.elements = (void**)calloc(1024, sizeof(void*));
+	for (size_t n = 0; n < 1024; n++) buf.put(n, &buf);
+	run("circular_buffer/get", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) keep(buf.get(i * 17));
+	});
+	free(buf.elements);
+}
+
+static void bench_delay_hist()
+{
+	DelayHist hist;
+	hist.clear(0);
+	uint32 sample = 100000;
+	uint64 ms = 0;
+	run("delay_hist/add_sample", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) {
+			// wander around a base, a minute of samples every 60000
+			sample += (i * 2654435761u >> 20) % 2000;
+			sample -= 1000;
+			hist.add_sample(sample, ms += (i & 1));
+		}
+		keep(hist.delay_base);
+	});
+	run("delay_hist/get_value", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) {
+			keep(&hist);
+			keep(hist.get_value());
+		}
+	});
+}
+
+// two contexts talking through queues instead of sockets
+struct Link {
+	utp_context *ctx[2];
+	std::deque<std::string> queue[2];	// datagrams on their way to ctx[i]
+	utp_socket *accepted;
+	bool drop;	// lose whatever is sent while set
+};
+
+static Link peers;
+static const PackedSockAddr link_addr[2] = { address(0x7f000001, 1000), address(0x7f000001, 2000) };
+
+static uint64 link_sendto(utp_callback_arguments *a)
+{
+	if (peers.drop) return 0;
+	const int to = a->context == peers.ctx[0] ? 1 : 0;
+	peers.queue[to].push_back(std::string((const char*)a->buf, a->len));
+	return 0;
+}
+
+static uint64 link_accept(utp_callback_arguments *a)
+{
+	peers.accepted = a->socket;
+	return 0;
+}
+
+static void link_pump()
+{
+	for (bool busy = true; busy; ) {
+		busy = false;
+		for (int i = 0; i < 2; i++) {
+			while (!peers.queue[i].empty()) {
+				std::string packet = peers.queue[i].front();
+				peers.queue[i].pop_front();
+				socklen_t len;
+				const SOCKADDR_STORAGE from = link_addr[1 - i].get_sockaddr_storage(&len);
+				utp_process_udp(peers.ctx[i], (const byte*)packet.data(), packet.size(), (const struct sockaddr*)&from, len);
+				busy = true;
+			}
+			utp_issue_deferred_acks(peers.ctx[i]);
+		}
+	}
+}
+
+// connects ctx[0] to ctx[1], returns the client socket
+static utp_socket *link_connect()
+{
+	for (int i = 0; i < 2; i++) {
+		peers.ctx[i] = utp_init(2);
+		utp_set_callback(peers.ctx[i], UTP_SENDTO, &link_sendto);
+		utp_set_callback(peers.ctx[i], UTP_ON_ACCEPT, &link_accept);
+	}
+	utp_socket *s = utp_create_socket(peers.ctx[0]);
+	socklen_t len;
+	const SOCKADDR_STORAGE to = link_addr[1].get_sockaddr_storage(&len);
+	utp_connect(s, (const struct sockaddr*)&to, len);
+	link_pump();
+	assert(peers.accepted);
+	return s;
+}
+
+static void bench_selective_ack_bytes(utp_socket *s)
+{
+	// fill a window opened wide with packets the peer never sees
+	static byte data[1000];
+	s->max_window = s->max_window_user = 1024 * 1024;
+	peers.drop = true;
+	for (int i = 0; i < 64 && utp_write(s, data, sizeof(data)) == sizeof(data); i++);
+	peers.drop = false;
+	if (s->cur_window_packets < 34) {
+		printf("%-32s skipped, only %u packets in flight\n", "selective_ack_bytes", (uint)s->cur_window_packets);
+		return;
+	}
+
+	// an eack acknowledging every other packet past the first one lost
+	const uint base = (s->seq_nr - s->cur_window_packets + 2) & ACK_NR_MASK;
+	const byte mask[4] = { 0x55, 0x55, 0x55, 0x55 };
+	run("selective_ack_bytes/32", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) {
+			int64 min_rtt = INT64_MAX;
+			keep(s->selective_ack_bytes(base, mask, sizeof(mask), min_rtt));
+			keep(min_rtt);
+		}
+	});
+}
+
+static void bench_process_udp()
+{
+	// a data packet the receiving end expects next, forged on the spot
+	UTPSocket *conn = peers.accepted;
+	const size_t payload = 1000;
+	byte packet[sizeof(PacketFormatV1) + payload];
+	memset(packet, 0, sizeof(packet));
+	PacketFormatV1 *pf = (PacketFormatV1*)packet;
+	pf->set_version(1);
+	pf->set_type(ST_DATA);
+	pf->connid = conn->conn_id_recv;
+	pf->windowsize = 1024 * 1024;
+	pf->ack_nr = conn->seq_nr - 1;
+
+	socklen_t len;
+	const SOCKADDR_STORAGE from = link_addr[0].get_sockaddr_storage(&len);
+	// acks go nowhere
+	peers.drop = true;
+	run("process_udp/in_order_data", [&](uint64 iterations) {
+		for (uint64 i = 0; i < iterations; i++) {
+			pf->seq_nr = conn->ack_nr + 1;
+			pf->tv_usec = (uint32)utp_call_get_microseconds(peers.ctx[1], NULL);
+			keep(utp_process_udp(peers.ctx[1], packet, sizeof(packet), (const struct sockaddr*)&from, len));
+			// one ack per batch, as after a recvmmsg
+			if ((i & 31) == 31) utp_issue_deferred_acks(peers.ctx[1]);
+		}
+	});
+	peers.drop = false;
+}
+
+int main(int argc, char *argv[])
+{
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) min_seconds = atof(argv[++i]);
+		else if (argv[i][0] != '-') filter = argv[i];
+		else {
+			fprintf(stderr, "usage: %s [name filter] [-t seconds per benchmark]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	bench_hash_table();
+	bench_sockaddr();
+	bench_circular_buffer();
+	bench_delay_hist();
+
+	utp_socket *s = link_connect();
+	bench_process_udp();
+	bench_selective_ack_bytes(s);
+
+	utp_destroy(peers.ctx[0]);
+	utp_destroy(peers.ctx[1]);
+	return 0;
+}
@@ -0,0 +1,555 @@
+// vim:set ts=4 sw=4 ai:
+
+// Load generator for libutp, grown out of ucat.c. It drives libutp directly
+// from a poll() loop, without node in the way, so the limits of the library
+// itself can be told apart from those of the binding.
+//
+// The client keeps a number of connections busy with exchanges: it sends a
+// request of -U bytes, the server answers with -D bytes, and the time from
+// the first byte of the request to the last of the answer is one latency
+// sample. With -k a connection is closed after that many exchanges and a new
+// one opened in its place, which measures connection churn as well.
+//
+//   uload -l -p 9000
+//   uload -c 100 -U 512 -D 16384 -t 10 127.0.0.1 9000
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <netdb.h>
+#include <signal.h>
+
+#include "utp.h"
+
+// options
+int o_debug;
+char *o_local_address,  *o_local_port,
+	 *o_remote_address, *o_remote_port;
+int o_listen;
+int o_connections = 1;
+uint32 o_upload = 1024;
+uint32 o_download = 1024;
+int o_churn;
+int o_seconds = 10;
+int o_interval;
+
+// what a client sends ahead of each request: the sizes of the request that
+// follows and of the answer it wants, in network order
+typedef struct {
+	uint32 upload;
+	uint32 download;
+} request_header;
+
+typedef struct {
+	utp_socket *s;
+	uint64 start;			// us, when the connect or the current exchange began
+	int exchanges;
+	// bytes of the current exchange still to send / to receive
+	uint32 write_left;
+	uint32 read_left;
+	// request header, written first by a client and collected by the server
+	request_header header;
+	uint32 header_done;
+} conn;
+
+utp_context *ctx;
+int fd;
+int quit_flag;
+
+// a block of zeros all payload is written from
+unsigned char payload[65536];
+
+// totals, reset when a report is printed
+uint64 bytes_up, bytes_down;
+uint64 exchanges;
+uint64 opened, connects, errors;
+utp_histogram exchange_hist, connect_hist;
+int live;
+
+uint64 report_start;
+
+void die(char *fmt, ...)
+{
+	va_list ap;
+	fflush(stdout);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+void debug(char *fmt, ...)
+{
+	va_list ap;
+	if (o_debug) {
+		fflush(stdout);
+		fprintf(stderr, "debug: ");
+		va_start(ap, fmt);
+		vfprintf(stderr, fmt, ap);
+		va_end(ap);
+		fflush(stderr);
+	}
+}
+
+void pdie(char *err)
+{
+	debug("errno %d\n", errno);
+	fflush(stdout);
+	perror(err);
+	exit(1);
+}
+
+uint64 now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void handler(int number)
+{
+	debug("caught signal\n");
+	quit_flag = 1;
+}
+
+void start_exchange(conn *c)
+{
+	c->start = now_us();
+	c->header.upload = htonl(o_upload);
+	c->header.download = htonl(o_download);
+	c->header_done = 0;
+	c->write_left = o_upload;
+	// even an empty answer is one byte, or the exchange could not end
+	c->read_left = o_download ? o_download : 1;
+}
+
+// writes as much of the pending header and payload as libutp takes
+void write_data(conn *c)
+{
+	size_t sent;
+
+	if (!o_listen) {
+		while (c->header_done < sizeof(c->header)) {
+			sent = utp_write(c->s, (unsigned char *)&c->header + c->header_done, sizeof(c->header) - c->header_done);
+			if (sent == 0) return;
+			c->header_done += sent;
+		}
+	}
+	while (c->write_left) {
+		sent = utp_write(c->s, payload, c->write_left < sizeof(payload) ? c->write_left : sizeof(payload));
+		if (sent == 0) {
+			debug("socket no longer writable\n");
+			return;
+		}
+		c->write_left -= sent;
+		bytes_up += sent;
+	}
+}
+
+void open_conn(struct sockaddr *addr, socklen_t addrlen)
+{
+	conn *c = calloc(1, sizeof(conn));
+	if (!c)
+		pdie("calloc");
+	c->s = utp_create_socket(ctx);
+	assert(c->s);
+	utp_set_userdata(c->s, c);
+	c->start = now_us();
+	opened++;
+	live++;
+	utp_connect(c->s, addr, addrlen);
+}
+
+struct sockaddr_storage remote;
+socklen_t remote_len;
+
+void on_exchange_done(conn *c)
+{
+	utp_histogram_add(&exchange_hist, (uint32)(now_us() - c->start));
+	exchanges++;
+	c->exchanges++;
+	if (quit_flag || (o_churn && c->exchanges >= o_churn)) {
+		utp_close(c->s);
+		return;
+	}
+	start_exchange(c);
+	write_data(c);
+}
+
+uint64 callback_on_read(utp_callback_arguments *a)
+{
+	conn *c = utp_get_userdata(a->socket);
+	const byte *p = a->buf;
+	size_t left = a->len;
+
+	utp_read_drained(a->socket);
+	if (!c)
+		return 0;
+
+	if (!o_listen) {
+		bytes_down += left;
+		if (left > c->read_left) {
+			fprintf(stderr, "Error: %zd bytes more than asked for\n", left - c->read_left);
+			left = c->read_left;
+		}
+		c->read_left -= left;
+		if (c->read_left == 0)
+			on_exchange_done(c);
+		return 0;
+	}
+
+	// the server collects a header, then the request it announced, then
+	// answers; a client only sends the next request once answered
+	bytes_up += left;
+	while (left) {
+		if (c->header_done < sizeof(c->header)) {
+			size_t n = sizeof(c->header) - c->header_done;
+			if (n > left) n = left;
+			memcpy((unsigned char *)&c->header + c->header_done, p, n);
+			c->header_done += n;
+			p += n;
+			left -= n;
+			if (c->header_done < sizeof(c->header))
+				break;
+			c->read_left = ntohl(c->header.upload);
+		}
+		size_t n = c->read_left < left ? c->read_left : left;
+		c->read_left -= n;
+		p += n;
+		left -= n;
+		if (c->read_left == 0) {
+			c->write_left = ntohl(c->header.download);
+			if (c->write_left == 0) c->write_left = 1;
+			bytes_down += c->write_left;
+			c->header_done = 0;
+			exchanges++;
+			write_data(c);
+		}
+	}
+	return 0;
+}
+
+uint64 callback_on_firewall(utp_callback_arguments *a)
+{
+	if (! o_listen) {
+		debug("Firewalling unexpected inbound connection in non-listen mode\n");
+		return 1;
+	}
+	return 0;
+}
+
+uint64 callback_on_accept(utp_callback_arguments *a)
+{
+	conn *c = calloc(1, sizeof(conn));
+	if (!c)
+		pdie("calloc");
+	c->s = a->socket;
+	utp_set_userdata(c->s, c);
+	opened++;
+	connects++;
+	live++;
+	debug("Accepted inbound socket %p\n", c->s);
+	return 0;
+}
+
+uint64 callback_on_error(utp_callback_arguments *a)
+{
+	debug("Error: %s\n", utp_error_code_names[a->error_code]);
+	errors++;
+	utp_close(a->socket);
+	return 0;
+}
+
+uint64 callback_on_state_change(utp_callback_arguments *a)
+{
+	conn *c = utp_get_userdata(a->socket);
+	if (!c)
+		return 0;
+
+	switch (a->state) {
+		case UTP_STATE_CONNECT:
+			// an accepted socket reports this too, once the first data is in
+			if (!o_listen) {
+				utp_histogram_add(&connect_hist, (uint32)(now_us() - c->start));
+				connects++;
+				start_exchange(c);
+			}
+			write_data(c);
+			break;
+
+		case UTP_STATE_WRITABLE:
+			write_data(c);
+			break;
+
+		case UTP_STATE_EOF:
+			utp_close(a->socket);
+			break;
+
+		case UTP_STATE_DESTROYING:
+			utp_set_userdata(a->socket, NULL);
+			free(c);
+			live--;
+			// a client keeps its number of connections up
+			if (!o_listen && !quit_flag)
+				open_conn((struct sockaddr *)&remote, remote_len);
+			break;
+	}
+
+	return 0;
+}
+
+uint64 callback_sendto(utp_callback_arguments *a)
+{
+	// a full socket buffer loses the packet like the network would
+	sendto(fd, a->buf, a->len, MSG_DONTWAIT, a->address, a->address_len);
+	return 0;
+}
+
+uint64 callback_log(utp_callback_arguments *a)
+{
+	fprintf(stderr, "log: %s\n", a->buf);
+	return 0;
+}
+
+void setup(void)
+{
+	struct addrinfo hints, *res;
+	int error;
+	struct sigaction sigIntHandler;
+	int size = 4 * 1024 * 1024;
+
+	sigIntHandler.sa_handler = handler;
+	sigemptyset(&sigIntHandler.sa_mask);
+	sigIntHandler.sa_flags = 0;
+
+	sigaction(SIGINT, &sigIntHandler, NULL);
+
+	fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (fd < 0)
+		pdie("socket");
+
+	// many connections at once overrun the default buffers
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_protocol = IPPROTO_UDP;
+
+	if ((error = getaddrinfo(o_local_address, o_local_port, &hints, &res)))
+		die("getaddrinfo: %s\n", gai_strerror(error));
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) != 0)
+		pdie("bind");
+
+	freeaddrinfo(res);
+
+	ctx = utp_init(2);
+	assert(ctx);
+
+	utp_set_callback(ctx, UTP_LOG,				&callback_log);
+	utp_set_callback(ctx, UTP_SENDTO,			&callback_sendto);
+	utp_set_callback(ctx, UTP_ON_ERROR,			&callback_on_error);
+	utp_set_callback(ctx, UTP_ON_STATE_CHANGE,	&callback_on_state_change);
+	utp_set_callback(ctx, UTP_ON_READ,			&callback_on_read);
+	utp_set_callback(ctx, UTP_ON_FIREWALL,		&callback_on_firewall);
+	utp_set_callback(ctx, UTP_ON_ACCEPT,		&callback_on_accept);
+
+	if (o_debug >= 2) {
+		utp_context_set_option(ctx, UTP_LOG_NORMAL, 1);
+		utp_context_set_option(ctx, UTP_LOG_MTU,    1);
+		utp_context_set_option(ctx, UTP_LOG_DEBUG,  1);
+	}
+
+	if (! o_listen) {
+		int i;
+
+		if ((error = getaddrinfo(o_remote_address, o_remote_port, &hints, &res)))
+			die("getaddrinfo: %s\n", gai_strerror(error));
+		memcpy(&remote, res->ai_addr, res->ai_addrlen);
+		remote_len = res->ai_addrlen;
+		freeaddrinfo(res);
+
+		for (i = 0; i < o_connections; i++)
+			open_conn((struct sockaddr *)&remote, remote_len);
+	}
+}
+
+void print_histogram(const char *name, const utp_histogram *h)
+{
+	if (!h->count) {
+		printf("%-10s no samples\n", name);
+		return;
+	}
+	printf("%-10s n=%llu min=%u p50=%u p90=%u p99=%u p99.9=%u max=%u mean=%llu (us)\n", name,
+		(unsigned long long)h->count, h->min,
+		utp_histogram_percentile(h, 50), utp_histogram_percentile(h, 90),
+		utp_histogram_percentile(h, 99), utp_histogram_percentile(h, 99.9),
+		h->max, (unsigned long long)(h->sum / h->count));
+}
+
+void report(void)
+{
+	uint64 now = now_us();
+	double secs = (now - report_start) / 1e6;
+	utp_context_stats *stats = utp_get_context_stats(ctx);
+
+	printf("%.3f s, %d connections live, %llu opened, %llu connected, %llu errors\n", secs, live,
+		(unsigned long long)opened, (unsigned long long)connects, (unsigned long long)errors);
+	printf("%llu exchanges, %.1f/s\n", (unsigned long long)exchanges, exchanges / secs);
+	printf("upload   %llu bytes, %.2f Mbit/s\n", (unsigned long long)bytes_up, bytes_up * 8 / secs / 1e6);
+	printf("download %llu bytes, %.2f Mbit/s\n", (unsigned long long)bytes_down, bytes_down * 8 / secs / 1e6);
+	if (!o_listen) {
+		print_histogram("exchange", &exchange_hist);
+		print_histogram("connect", &connect_hist);
+	}
+	print_histogram("rtt", utp_context_get_histogram(ctx, UTP_HISTOGRAM_RTT));
+	print_histogram("delay", utp_context_get_histogram(ctx, UTP_HISTOGRAM_DELAY));
+	if (stats)
+		printf("syn accepted %u, rejected %u, rst sent %u\n", stats->syn_accepted, stats->syn_rejected, stats->rst_sent);
+	printf("\n");
+	fflush(stdout);
+
+	report_start = now;
+	bytes_up = bytes_down = exchanges = 0;
+	opened = connects = errors = 0;
+	memset(&exchange_hist, 0, sizeof(exchange_hist));
+	memset(&connect_hist, 0, sizeof(connect_hist));
+	memset(utp_context_get_histogram(ctx, UTP_HISTOGRAM_RTT), 0, sizeof(utp_histogram));
+	memset(utp_context_get_histogram(ctx, UTP_HISTOGRAM_DELAY), 0, sizeof(utp_histogram));
+}
+
+void network_loop(void)
+{
+	unsigned char socket_data[4096];
+	struct sockaddr_storage src_addr;
+	socklen_t addrlen;
+	ssize_t len;
+	int ret;
+	struct pollfd p;
+
+	p.fd = fd;
+	p.events = POLLIN;
+
+	ret = poll(&p, 1, 50);
+	if (ret < 0) {
+		if (errno != EINTR)
+			pdie("poll");
+	}
+	else if (ret > 0 && (p.revents & POLLIN)) {
+		while (1) {
+			addrlen = sizeof(src_addr);
+			len = recvfrom(fd, socket_data, sizeof(socket_data), MSG_DONTWAIT, (struct sockaddr *)&src_addr, &addrlen);
+			if (len < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					utp_issue_deferred_acks(ctx);
+					break;
+				}
+				else if (errno != ECONNREFUSED)
+					pdie("recv");
+				continue;
+			}
+
+			if (! utp_process_udp(ctx, socket_data, len, (struct sockaddr *)&src_addr, addrlen))
+				debug("UDP packet not handled by UTP.  Ignoring.\n");
+		}
+	}
+
+	utp_check_timeouts(ctx);
+}
+
+void usage(char *name)
+{
+	fprintf(stderr, "\nUsage:\n");
+	fprintf(stderr, "    %s [options] <destination-IP> <destination-port>\n", name);
+	fprintf(stderr, "    %s [options] -l -p <listening-port>\n", name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "    -h          Help\n");
+	fprintf(stderr, "    -d          Debug mode; use multiple times to increase verbosity.\n");
+	fprintf(stderr, "    -l          Listen mode\n");
+	fprintf(stderr, "    -p <port>   Local port\n");
+	fprintf(stderr, "    -s <IP>     Source IP\n");
+	fprintf(stderr, "    -c <n>      Connections kept open at once (1)\n");
+	fprintf(stderr, "    -U <bytes>  Request size (1024)\n");
+	fprintf(stderr, "    -D <bytes>  Answer size (1024)\n");
+	fprintf(stderr, "    -k <n>      Reconnect after n exchanges, 0 never (0)\n");
+	fprintf(stderr, "    -t <secs>   Run time of a client, 0 until interrupted (10)\n");
+	fprintf(stderr, "    -i <secs>   Report every so many seconds as well as at the end\n");
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+	uint64 end, next_report;
+
+	o_local_address = "0.0.0.0";
+
+	while (1) {
+		int c = getopt (argc, argv, "hdlp:s:c:U:D:k:t:i:");
+		if (c == -1) break;
+		switch(c) {
+			case 'h': usage(argv[0]);					break;
+			case 'd': o_debug++;						break;
+			case 'l': o_listen++;						break;
+			case 'p': o_local_port = optarg;			break;
+			case 's': o_local_address = optarg;			break;
+			case 'c': o_connections = atoi(optarg);		break;
+			case 'U': o_upload = strtoul(optarg, NULL, 0);		break;
+			case 'D': o_download = strtoul(optarg, NULL, 0);	break;
+			case 'k': o_churn = atoi(optarg);			break;
+			case 't': o_seconds = atoi(optarg);			break;
+			case 'i': o_interval = atoi(optarg);		break;
+			default:
+				die("Unhandled argument: %c\n", c);
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		switch(i - optind) {
+			case 0:	o_remote_address = argv[i]; 	break;
+			case 1:	o_remote_port = argv[i];		break;
+		}
+	}
+
+	if (o_listen && (o_remote_port || o_remote_address))
+		usage(argv[0]);
+
+	if (! o_listen && (!o_remote_port || !o_remote_address))
+		usage(argv[0]);
+
+	if (o_connections < 1)
+		usage(argv[0]);
+
+	report_start = now_us();
+	setup();
+
+	end = !o_listen && o_seconds ? report_start + (uint64)o_seconds * 1000000 : 0;
+	next_report = o_interval ? report_start + (uint64)o_interval * 1000000 : 0;
+	while (!quit_flag) {
+		network_loop();
+		uint64 now = now_us();
+		if (next_report && now >= next_report) {
+			report();
+			next_report += (uint64)o_interval * 1000000;
+		}
+		if (end && now >= end)
+			quit_flag = 1;
+	}
+
+	report();
+	utp_destroy(ctx);
+	return 0;
+}
@@ -0,0 +1,619 @@
+// In-process network emulator. Two contexts are joined by a pair of emulated
+// links instead of UDP sockets: libutp's UTP_SENDTO callback hands datagrams
+// to a link, which delivers them through utp_process_udp once they have been
+// queued, serialized at the link's rate and propagated. A link models
+//
+//   - bandwidth, with a drop-tail queue of a given size or CoDel in front
+//   - propagation delay
+//   - random loss, reordering (a packet held back so later ones overtake it)
+//     and duplication
+//
+// A number of bulk flows go from the first context to the second over the
+// same bottleneck, so LEDBAT's delay target, throughput under loss and the
+// fairness between flows can be measured without root or tc netem. Random
+// choices come from a seeded generator, libutp's own included.
+//
+// The clock is virtual unless -w is given: it jumps from one event to the
+// next, libutp's timers included (UTP_EXACT_TIMEOUTS and utp_next_timeout),
+// so an hour of traffic takes as long as the packets take to process and a
+// seed always gives the same run. With -w it follows the wall clock and the
+// timers are checked every 10 ms, as an application would.
+//
+// usage: unetem [options], -h lists them
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <queue>
+#include <deque>
+#include <vector>
+#include <string>
+
+#include "utp.h"
+
+#define MTU 1500
+
+enum { AQM_DROPTAIL, AQM_CODEL };
+
+struct LinkConfig {
+	double rate;		// bytes per second, 0 = unlimited
+	uint64 delay;		// propagation delay (us)
+	size_t queue;		// bytes the queue holds
+	int aqm;
+	double loss;		// probabilities, 0..1
+	double reorder;
+	uint64 reorder_delay;	// extra delay of a reordered packet (us)
+	double duplicate;
+};
+
+struct Packet {
+	std::string data;
+	int to;				// index of the receiving context
+	uint64 enqueued;	// us
+};
+
+struct LinkStats {
+	uint64 packets, bytes;		// delivered
+	uint64 lost, queue_drops, aqm_drops;
+	uint64 reordered, duplicated;
+	utp_histogram sojourn;		// time spent queued (us)
+};
+
+struct Link {
+	LinkConfig config;
+	std::deque<Packet*> queue;
+	size_t queued_bytes;
+	bool busy;					// a packet is being serialized
+	LinkStats stats;
+
+	// CoDel state (RFC 8289)
+	uint64 first_above_time;
+	uint64 drop_next;
+	uint32 count, last_count;
+	bool dropping;
+};
+
+enum { EV_TX_DONE, EV_DELIVER, EV_START, EV_TIMEOUT, EV_TICK, EV_REPORT };
+
+struct Event {
+	uint64 time;
+	uint64 seq;		// keeps events at the same time in order
+	int type;
+	int link;
+	Packet *packet;
+	bool operator<(const Event &other) const {
+		return time != other.time ? time > other.time : seq > other.seq;
+	}
+};
+
+struct Flow {
+	utp_socket *s;
+	uint32 id;
+	uint64 start;			// us
+	// receiving side
+	uint64 received, interval_received;
+	byte header[4];
+	size_t header_done;
+};
+
+// options
+static double o_rate = 10;			// Mbit/s
+static double o_delay = 20;			// ms, one way
+static size_t o_queue = 100 * MTU;
+static int o_aqm = AQM_DROPTAIL;
+static double o_loss, o_reorder, o_duplicate;
+static double o_reorder_delay = 10;	// ms
+static int o_both;					// impair the ack path as well
+static int o_flows = 1;
+static double o_stagger;			// s between flow starts
+static double o_seconds = 30;
+static unsigned o_seed = 1;
+static int o_interval = 1000;		// ms between reports, 0 for none
+static int o_target_delay;			// us, 0 for libutp's default
+static int o_wall;					// run on the wall clock
+
+static utp_context *ctx[2];
+static SOCKADDR_STORAGE addr[2];
+static socklen_t addr_len;
+static Link links[2];				// links[i] carries datagrams to ctx[i]
+static std::priority_queue<Event> events;
+static uint64 event_seq;
+static std::vector<Flow> flows;
+static uint64 start_time;			// wall clock at 0
+static uint64 sim_time;				// virtual clock, the current event's time
+static uint64 timeout_at = UINT64_MAX;	// the EV_TIMEOUT scheduled, if any
+
+// xorshift64*, so a seed gives the same run everywhere
+static uint64 rng_state;
+
+static uint64 rng()
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return rng_state * 2685821657736338717ULL;
+}
+
+static bool chance(double p)
+{
+	return p > 0 && (rng() >> 11) * (1.0 / 9007199254740992.0) < p;
+}
+
+static uint64 wall_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the emulation's clock in us, starting at 0
+static uint64 now()
+{
+	return o_wall ? wall_us() - start_time : sim_time;
+}
+
+static void schedule(uint64 time, int type, int link = 0, Packet *packet = NULL)
+{
+	Event e = { time, event_seq++, type, link, packet };
+	events.push(e);
+}
+
+static uint64 callback_get_microseconds(utp_callback_arguments *a)
+{
+	return now();
+}
+
+static uint64 callback_get_milliseconds(utp_callback_arguments *a)
+{
+	return now() / 1000;
+}
+
+static uint64 callback_get_random(utp_callback_arguments *a)
+{
+	return rng() >> 33;
+}
+
+// CoDel's verdict on the packet at the head of the queue
+static bool codel_ok_to_drop(Link &l, Packet *p, uint64 t)
+{
+	static const uint64 target = 5000, interval = 100000;
+	// t can trail the clock the packet was queued by when the loop runs late
+	const uint64 sojourn = t > p->enqueued ? t - p->enqueued : 0;
+	if (sojourn < target || l.queued_bytes <= MTU) {
+		l.first_above_time = 0;
+		return false;
+	}
+	if (l.first_above_time == 0) {
+		l.first_above_time = t + interval;
+		return false;
+	}
+	return t >= l.first_above_time;
+}
+
+static uint64 codel_control_law(uint64 t, uint32 count)
+{
+	return t + (uint64)(100000 / sqrt((double)count));
+}
+
+static Packet *pop(Link &l)
+{
+	if (l.queue.empty()) return NULL;
+	Packet *p = l.queue.front();
+	l.queue.pop_front();
+	l.queued_bytes -= p->data.size();
+	return p;
+}
+
+static void drop(Link &l, Packet *p)
+{
+	l.stats.aqm_drops++;
+	delete p;
+}
+
+// the next packet to serialize, after whatever the AQM drops
+static Packet *dequeue(Link &l, uint64 t)
+{
+	Packet *p = pop(l);
+	if (!p || l.config.aqm != AQM_CODEL) return p;
+
+	bool ok_to_drop = codel_ok_to_drop(l, p, t);
+	if (l.dropping) {
+		if (!ok_to_drop) {
+			l.dropping = false;
+		} else {
+			while (t >= l.drop_next && l.dropping) {
+				drop(l, p);
+				l.count++;
+				p = pop(l);
+				if (!p || !codel_ok_to_drop(l, p, t)) {
+					l.dropping = false;
+				} else {
+					l.drop_next = codel_control_law(l.drop_next, l.count);
+				}
+			}
+		}
+	} else if (ok_to_drop) {
+		drop(l, p);
+		p = pop(l);
+		l.dropping = true;
+		const uint32 delta = l.count - l.last_count;
+		l.count = delta > 1 && t - l.drop_next < 16 * 100000 ? delta : 1;
+		l.drop_next = codel_control_law(t, l.count);
+		l.last_count = l.count;
+	}
+	return p;
+}
+
+// starts serializing the next packet if the link is idle
+static void transmit(int link, uint64 t)
+{
+	Link &l = links[link];
+	if (l.busy) return;
+	Packet *p = dequeue(l, t);
+	if (!p) return;
+	utp_histogram_add(&l.stats.sojourn, t > p->enqueued ? (uint32)(t - p->enqueued) : 0);
+	l.busy = true;
+	const uint64 tx = l.config.rate > 0 ? (uint64)(p->data.size() * 1e6 / l.config.rate) : 0;
+	schedule(t + tx, EV_TX_DONE, link, p);
+}
+
+// a packet is on the wire: propagate it, maybe late, maybe twice
+static void propagate(int link, Packet *p, uint64 t)
+{
+	Link &l = links[link];
+	uint64 arrival = t + l.config.delay;
+	if (chance(l.config.reorder)) {
+		arrival += l.config.reorder_delay;
+		l.stats.reordered++;
+	}
+	if (chance(l.config.duplicate)) {
+		l.stats.duplicated++;
+		schedule(arrival + 1, EV_DELIVER, link, new Packet(*p));
+	}
+	schedule(arrival, EV_DELIVER, link, p);
+}
+
+static uint64 callback_sendto(utp_callback_arguments *a)
+{
+	const int to = a->context == ctx[0] ? 1 : 0;
+	Link &l = links[to];
+	const uint64 t = now();
+	if (chance(l.config.loss)) {
+		l.stats.lost++;
+		return 0;
+	}
+	if (l.queued_bytes + a->len > l.config.queue) {
+		l.stats.queue_drops++;
+		return 0;
+	}
+	Packet *p = new Packet;
+	p->data.assign((const char*)a->buf, a->len);
+	p->to = to;
+	p->enqueued = t;
+	l.queue.push_back(p);
+	l.queued_bytes += a->len;
+	transmit(to, t);
+	return 0;
+}
+
+static void deliver(int link, Packet *p)
+{
+	Link &l = links[link];
+	l.stats.packets++;
+	l.stats.bytes += p->data.size();
+	utp_process_udp(ctx[p->to], (const byte*)p->data.data(), p->data.size(), (const struct sockaddr*)&addr[1 - p->to], addr_len);
+	delete p;
+}
+
+static void write_flow(Flow &f)
+{
+	static byte payload[65536];
+	if (f.header_done < sizeof(f.header)) {
+		f.header_done += utp_write(f.s, f.header + f.header_done, sizeof(f.header) - f.header_done);
+		if (f.header_done < sizeof(f.header)) return;
+	}
+	while (utp_write(f.s, payload, sizeof(payload)) > 0);
+}
+
+static uint64 callback_on_accept(utp_callback_arguments *a)
+{
+	Flow *f = new Flow();
+	f->s = a->socket;
+	f->id = UINT_MAX;
+	utp_set_userdata(a->socket, f);
+	return 0;
+}
+
+// a receiving socket learns its flow from the first four bytes
+static uint64 callback_on_read(utp_callback_arguments *a)
+{
+	Flow *f = (Flow*)utp_get_userdata(a->socket);
+	const byte *p = a->buf;
+	size_t len = a->len;
+	utp_read_drained(a->socket);
+	while (f->header_done < sizeof(f->header) && len) {
+		f->header[f->header_done++] = *p++;
+		len--;
+		if (f->header_done == sizeof(f->header)) {
+			uint32 id;
+			memcpy(&id, f->header, sizeof(id));
+			f->id = ntohl(id);
+		}
+	}
+	if (f->id < flows.size()) {
+		flows[f->id].received += len;
+		flows[f->id].interval_received += len;
+	}
+	return 0;
+}
+
+static uint64 callback_on_state_change(utp_callback_arguments *a)
+{
+	if (a->context != ctx[0]) {
+		if (a->state == UTP_STATE_EOF) utp_close(a->socket);
+		if (a->state == UTP_STATE_DESTROYING) delete (Flow*)utp_get_userdata(a->socket);
+		return 0;
+	}
+	Flow *f = (Flow*)utp_get_userdata(a->socket);
+	if (a->state == UTP_STATE_CONNECT || a->state == UTP_STATE_WRITABLE) write_flow(*f);
+	return 0;
+}
+
+static uint64 callback_on_error(utp_callback_arguments *a)
+{
+	fprintf(stderr, "%.3f: %s on %s side\n", now() / 1e6, utp_error_code_names[a->error_code],
+		a->context == ctx[0] ? "sending" : "receiving");
+	return 0;
+}
+
+static void start_flow(Flow &f)
+{
+	f.s = utp_create_socket(ctx[0]);
+	utp_set_userdata(f.s, &f);
+	const uint32 id = htonl(f.id);
+	memcpy(f.header, &id, sizeof(id));
+	utp_connect(f.s, (const struct sockaddr*)&addr[1], addr_len);
+}
+
+static void report(uint64 t)
+{
+	const double secs = o_interval / 1000.;
+	printf("t=%.1f", t / 1e6);
+	for (size_t i = 0; i < flows.size(); i++) {
+		printf(" f%zu=%.2f", i, flows[i].interval_received * 8 / secs / 1e6);
+		flows[i].interval_received = 0;
+	}
+	utp_socket_stats *stats = flows[0].s ? utp_get_stats(flows[0].s) : NULL;
+	printf(" queue=%zu", links[1].queued_bytes);
+	if (stats) printf(" cwnd0=%u rtt0=%u", stats->max_window, stats->rtt);
+	printf("\n");
+}
+
+static void print_histogram(const char *name, const utp_histogram *h)
+{
+	if (!h->count) {
+		printf("%-14s no samples\n", name);
+		return;
+	}
+	printf("%-14s p50=%u p90=%u p99=%u max=%u mean=%llu (us)\n", name,
+		utp_histogram_percentile(h, 50), utp_histogram_percentile(h, 90),
+		utp_histogram_percentile(h, 99), h->max, (unsigned long long)(h->sum / h->count));
+}
+
+static void summary(uint64 t)
+{
+	const double secs = t / 1e6;
+	double total = 0, sum = 0, sum_squares = 0;
+	printf("\n%.1f s, %d flows over %.2f Mbit/s, %.1f ms, %s queue of %zu bytes\n", secs, o_flows,
+		o_rate, o_delay, o_aqm == AQM_CODEL ? "codel" : "drop-tail", o_queue);
+	for (size_t i = 0; i < flows.size(); i++) {
+		// over the time the flow was running
+		const double running = secs - flows[i].start / 1e6;
+		const double mbps = running > 0 ? flows[i].received * 8 / running / 1e6 : 0;
+		printf("flow %zu: %llu bytes, %.3f Mbit/s\n", i, (unsigned long long)flows[i].received, mbps);
+		total += flows[i].received * 8 / secs / 1e6;
+		sum += mbps;
+		sum_squares += mbps * mbps;
+	}
+	printf("total %.3f Mbit/s", total);
+	if (o_rate > 0) printf(", utilization %.1f%%", total / o_rate * 100);
+	// Jain's index: 1 when all flows get the same, 1/n when one gets it all
+	printf(", fairness %.3f\n", sum_squares > 0 ? sum * sum / (flows.size() * sum_squares) : 0);
+
+	const LinkStats &s = links[1].stats;
+	printf("bottleneck: %llu packets, %llu lost, %llu queue drops, %llu aqm drops, %llu reordered, %llu duplicated\n",
+		(unsigned long long)s.packets, (unsigned long long)s.lost, (unsigned long long)s.queue_drops,
+		(unsigned long long)s.aqm_drops, (unsigned long long)s.reordered, (unsigned long long)s.duplicated);
+	print_histogram("queueing delay", &s.sojourn);
+	print_histogram("rtt", utp_context_get_histogram(ctx[0], UTP_HISTOGRAM_RTT));
+	print_histogram("ledbat delay", utp_context_get_histogram(ctx[0], UTP_HISTOGRAM_DELAY));
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "\nUsage:\n");
+	fprintf(stderr, "    %s [options]\n", name);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "    -h           Help\n");
+	fprintf(stderr, "    -r <Mbit/s>  Bottleneck rate, 0 for unlimited (10)\n");
+	fprintf(stderr, "    -d <ms>      One-way propagation delay (20)\n");
+	fprintf(stderr, "    -q <bytes>   Queue size (150000)\n");
+	fprintf(stderr, "    -a <aqm>     droptail or codel (droptail)\n");
+	fprintf(stderr, "    -l <%%>       Random loss\n");
+	fprintf(stderr, "    -o <%%>       Packets reordered\n");
+	fprintf(stderr, "    -O <ms>      How long a reordered packet is held back (10)\n");
+	fprintf(stderr, "    -u <%%>       Packets duplicated\n");
+	fprintf(stderr, "    -b           Loss, reordering and duplication on the ack path too\n");
+	fprintf(stderr, "    -n <flows>   Number of flows (1)\n");
+	fprintf(stderr, "    -s <secs>    Time between flow starts (0)\n");
+	fprintf(stderr, "    -t <secs>    Duration (30)\n");
+	fprintf(stderr, "    -S <seed>    Random seed (1)\n");
+	fprintf(stderr, "    -i <ms>      Report interval, 0 for only a summary (1000)\n");
+	fprintf(stderr, "    -T <us>      LEDBAT target delay\n");
+	fprintf(stderr, "    -w           Run on the wall clock instead of a virtual one\n");
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	while (1) {
+		int c = getopt(argc, argv, "hr:d:q:a:l:o:O:u:bn:s:t:S:i:T:w");
+		if (c == -1) break;
+		switch (c) {
+			case 'r': o_rate = atof(optarg);					break;
+			case 'd': o_delay = atof(optarg);					break;
+			case 'q': o_queue = strtoul(optarg, NULL, 0);		break;
+			case 'a':
+				if (strcmp(optarg, "codel") == 0) o_aqm = AQM_CODEL;
+				else if (strcmp(optarg, "droptail") == 0) o_aqm = AQM_DROPTAIL;
+				else usage(argv[0]);
+				break;
+			case 'l': o_loss = atof(optarg) / 100;				break;
+			case 'o': o_reorder = atof(optarg) / 100;			break;
+			case 'O': o_reorder_delay = atof(optarg);			break;
+			case 'u': o_duplicate = atof(optarg) / 100;			break;
+			case 'b': o_both = 1;								break;
+			case 'n': o_flows = atoi(optarg);					break;
+			case 's': o_stagger = atof(optarg);					break;
+			case 't': o_seconds = atof(optarg);					break;
+			case 'S': o_seed = strtoul(optarg, NULL, 0);		break;
+			case 'i': o_interval = atoi(optarg);				break;
+			case 'T': o_target_delay = atoi(optarg);			break;
+			case 'w': o_wall = 1;								break;
+			default: usage(argv[0]);
+		}
+	}
+	if (o_flows < 1 || o_seconds <= 0) usage(argv[0]);
+
+	rng_state = 0x9e3779b97f4a7c15ULL ^ o_seed;
+	if (!rng_state) rng_state = 1;
+
+	// links[1] is the bottleneck towards the receiver, links[0] the ack path
+	for (int i = 0; i < 2; i++) {
+		Link &l = links[i];
+		memset(&l.stats, 0, sizeof(l.stats));
+		l.config.delay = (uint64)(o_delay * 1000);
+		l.config.rate = i == 1 ? o_rate * 1e6 / 8 : 0;
+		l.config.queue = i == 1 ? o_queue : SIZE_MAX;
+		l.config.aqm = i == 1 ? o_aqm : AQM_DROPTAIL;
+		if (i == 1 || o_both) {
+			l.config.loss = o_loss;
+			l.config.reorder = o_reorder;
+			l.config.duplicate = o_duplicate;
+		}
+		l.config.reorder_delay = (uint64)(o_reorder_delay * 1000);
+	}
+
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	for (int i = 0; i < 2; i++) {
+		sin.sin_addr.s_addr = htonl(0x0a000001 + i);
+		sin.sin_port = htons(6881);
+		memcpy(&addr[i], &sin, sizeof(sin));
+	}
+	addr_len = sizeof(sin);
+
+	start_time = wall_us();
+	for (int i = 0; i < 2; i++) {
+		ctx[i] = utp_init(2);
+		utp_set_callback(ctx[i], UTP_SENDTO,			&callback_sendto);
+		utp_set_callback(ctx[i], UTP_GET_MICROSECONDS,	&callback_get_microseconds);
+		utp_set_callback(ctx[i], UTP_GET_MILLISECONDS,	&callback_get_milliseconds);
+		utp_set_callback(ctx[i], UTP_GET_RANDOM,		&callback_get_random);
+		utp_set_callback(ctx[i], UTP_ON_STATE_CHANGE,	&callback_on_state_change);
+		utp_set_callback(ctx[i], UTP_ON_ERROR,			&callback_on_error);
+		if (o_target_delay) utp_context_set_option(ctx[i], UTP_TARGET_DELAY, o_target_delay);
+		if (!o_wall) utp_context_set_option(ctx[i], UTP_EXACT_TIMEOUTS, 1);
+	}
+	utp_set_callback(ctx[1], UTP_ON_ACCEPT,	&callback_on_accept);
+	utp_set_callback(ctx[1], UTP_ON_READ,	&callback_on_read);
+
+	flows.resize(o_flows);
+	for (int i = 0; i < o_flows; i++) {
+		flows[i].id = i;
+		flows[i].start = (uint64)(i * o_stagger * 1e6);
+		schedule(flows[i].start, EV_START, i);
+	}
+
+	const uint64 end = (uint64)(o_seconds * 1e6);
+	if (o_wall) schedule(0, EV_TICK);
+	if (o_interval > 0) schedule((uint64)o_interval * 1000, EV_REPORT);
+
+	while (!events.empty() && events.top().time < end) {
+		if (o_wall) {
+			// sleep until the next event is due
+			const uint64 t = now();
+			if (events.top().time > t) {
+				usleep((useconds_t)std::min<uint64>(events.top().time - t, 10000));
+				continue;
+			}
+		}
+
+		const Event e = events.top();
+		events.pop();
+		sim_time = e.time;
+		switch (e.type) {
+			case EV_TX_DONE:
+				links[e.link].busy = false;
+				propagate(e.link, e.packet, e.time);
+				transmit(e.link, e.time);
+				break;
+			case EV_DELIVER:
+				deliver(e.link, e.packet);
+				break;
+			case EV_START:
+				start_flow(flows[e.link]);
+				break;
+			case EV_TIMEOUT:
+				// a later one replaced by an earlier one is stale
+				if (e.time != timeout_at) continue;
+				timeout_at = UINT64_MAX;
+				for (int i = 0; i < 2; i++) utp_check_timeouts(ctx[i]);
+				break;
+			case EV_TICK:
+				for (int i = 0; i < 2; i++) {
+					utp_issue_deferred_acks(ctx[i]);
+					utp_check_timeouts(ctx[i]);
+				}
+				schedule(e.time + 10000, EV_TICK);
+				break;
+			case EV_REPORT:
+				report(e.time);
+				schedule(e.time + (uint64)o_interval * 1000, EV_REPORT);
+				break;
+		}
+		// acks held back while a batch arrives go out once it is in
+		if (e.type == EV_DELIVER && (events.empty() || events.top().type != EV_DELIVER || events.top().time > e.time)) {
+			for (int i = 0; i < 2; i++) utp_issue_deferred_acks(ctx[i]);
+		}
+
+		if (!o_wall) {
+			// wake up for the earliest timer either side has, never twice
+			// at the same time in a row so a timer that stays due can't
+			// hold the clock still
+			uint64 next = std::min(utp_next_timeout(ctx[0]), utp_next_timeout(ctx[1])) * 1000;
+			if (e.type == EV_TIMEOUT) next = std::max(next, e.time + 1000);
+			next = std::max(next, e.time);
+			if (next < timeout_at) {
+				timeout_at = next;
+				schedule(next, EV_TIMEOUT);
+			}
+		}
+	}
+
+	summary(end);
+	fflush(stdout);
+	return 0;
+}
@@ -0,0 +1,254 @@
+// What many mostly idle connections cost. Opens connections between two
+// contexts joined by in-memory queues in steps (10k, 50k, 100k by default)
+// and at every step reports the memory per socket, what the socket hash
+// table takes of it, the time utp_check_timeouts spends on a sweep, and how
+// long utp_process_udp takes for the few connections kept busy meanwhile.
+// utp_internal.cpp is compiled in for the sizes of the internal types.
+//
+// Connection ids are 16 bits, so the connections are spread over address
+// pairs, CONNS_PER_PEER each, as they would be over many peers.
+//
+// usage: uscale [-n 10000,50000,100000] [-a active connections] [-r rounds]
+
+#include "utp_internal.cpp"
+
+#include <time.h>
+#include <unistd.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include <deque>
+#include <vector>
+#include <string>
+
+static uint64 now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t rss_bytes()
+{
+	unsigned long size = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f) {
+		if (fscanf(f, "%lu %lu", &size, &resident) != 2) resident = 0;
+		fclose(f);
+	}
+	return resident * sysconf(_SC_PAGESIZE);
+}
+
+// 0 where mallinfo2() is missing (glibc before 2.33, other libcs), the
+// heap columns then read 0 and only rss counts
+static size_t heap_bytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	// large blocks come straight from mmap and are counted apart
+	const struct mallinfo2 info = mallinfo2();
+	return info.uordblks + info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+static PackedSockAddr address(uint32 ip, uint16 port)
+{
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(ip);
+	sin.sin_port = htons(port);
+	return PackedSockAddr((const SOCKADDR_STORAGE*)&sin, sizeof(sin));
+}
+
+#define CONNS_PER_PEER 10000
+// ctx[0] uses ports from CLIENT_PORT up and ctx[1] the same number of
+// ports from SERVER_PORT; client port n talks to server port n + PEER_OFFSET
+#define CLIENT_PORT 10000
+#define SERVER_PORT 30000
+#define PEER_OFFSET (SERVER_PORT - CLIENT_PORT)
+
+struct Datagram {
+	std::string data;
+	SOCKADDR_STORAGE from;
+};
+
+// the two contexts and the datagrams on their way to each
+static utp_context *ctx[2];
+static std::deque<Datagram> queue[2];
+static socklen_t addr_len;
+
+// utp_process_udp times while measuring, in ns
+static bool timing;
+static utp_histogram process_hist;
+
+static uint64 callback_sendto(utp_callback_arguments *a)
+{
+	Datagram d;
+	d.data.assign((const char*)a->buf, a->len);
+	// it comes from the port paired with the one it goes to
+	memcpy(&d.from, a->address, a->address_len);
+	struct sockaddr_in *from = (struct sockaddr_in*)&d.from;
+	const int to_server = a->context == ctx[0];
+	from->sin_port = htons(ntohs(from->sin_port) + (to_server ? -PEER_OFFSET : PEER_OFFSET));
+	queue[to_server].push_back(d);
+	return 0;
+}
+
+// a context without it refuses incoming connections
+static uint64 callback_on_accept(utp_callback_arguments *a)
+{
+	return 0;
+}
+
+static uint64 callback_on_read(utp_callback_arguments *a)
+{
+	utp_read_drained(a->socket);
+	return 0;
+}
+
+// delivers datagrams until both sides are quiet
+static void pump()
+{
+	for (bool busy = true; busy; ) {
+		busy = false;
+		for (int i = 0; i < 2; i++) {
+			while (!queue[i].empty()) {
+				const Datagram d = queue[i].front();
+				queue[i].pop_front();
+				const uint64 start = timing ? now_ns() : 0;
+				utp_process_udp(ctx[i], (const byte*)d.data.data(), d.data.size(), (const struct sockaddr*)&d.from, addr_len);
+				if (timing) utp_histogram_add(&process_hist, (uint32)(now_ns() - start));
+				busy = true;
+			}
+			utp_issue_deferred_acks(ctx[i]);
+		}
+	}
+}
+
+// a full pass over every socket, whenever it was last done
+static uint64 sweep(utp_context *c)
+{
+	c->last_check = 0;
+	const uint64 start = now_ns();
+	utp_check_timeouts(c);
+	return now_ns() - start;
+}
+
+// memory a socket hash table of n entries takes on its own
+static size_t table_bytes(size_t n)
+{
+	const size_t before = heap_bytes();
+	UTPSocketHT *table = new UTPSocketHT;
+	for (size_t i = 0; i < n; i++) {
+		table->Add(UTPSocketKey(address(0x0a000000 + (uint32)i, 6881), (uint32)i))->socket = NULL;
+	}
+	const size_t bytes = heap_bytes() - before;
+	// no sockets behind the entries for the destructor to free
+	delete table;
+	return bytes;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-n 10000,50000,100000] [-a active connections] [-r rounds]\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<size_t> steps;
+	size_t active = 16;
+	int rounds = 200;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+			for (char *p = argv[++i]; *p; ) {
+				steps.push_back(strtoul(p, &p, 0));
+				if (*p == ',') p++;
+				else if (*p) usage(argv[0]);
+			}
+		}
+		else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) active = strtoul(argv[++i], NULL, 0);
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) rounds = atoi(argv[++i]);
+		else usage(argv[0]);
+	}
+	if (steps.empty()) {
+		steps.push_back(10000);
+		steps.push_back(50000);
+		steps.push_back(100000);
+	}
+
+	for (int i = 0; i < 2; i++) {
+		ctx[i] = utp_init(2);
+		utp_set_callback(ctx[i], UTP_SENDTO, &callback_sendto);
+		utp_set_callback(ctx[i], UTP_ON_READ, &callback_on_read);
+		utp_set_callback(ctx[i], UTP_ON_ACCEPT, &callback_on_accept);
+		utp_context_set_option(ctx[i], UTP_MAX_SOCKETS, 0);
+	}
+
+	printf("sizeof(UTPSocket) %zu, sizeof(UTPSocketKeyData) %zu\n\n", sizeof(UTPSocket), sizeof(UTPSocketKeyData));
+	printf("%10s %12s %12s %12s %12s %12s %10s %10s %10s\n",
+		"conns", "rss/conn", "heap/conn", "table/sock", "sweep_us", "sweep_cpu%", "p50_ns", "p99_ns", "p99.9_ns");
+
+	const size_t rss_base = rss_bytes(), heap_base = heap_bytes();
+	std::vector<utp_socket*> sockets;
+	static byte payload[1000];
+
+	for (size_t step = 0; step < steps.size(); step++) {
+		// open connections up to the step, each with one byte sent so the
+		// accepting side sees it connected as well
+		while (sockets.size() < steps[step]) {
+			const size_t batch = min<size_t>(steps[step] - sockets.size(), 1000);
+			for (size_t i = 0; i < batch; i++) {
+				utp_socket *s = utp_create_socket(ctx[0]);
+				const uint16 port = SERVER_PORT + sockets.size() / CONNS_PER_PEER;
+				const SOCKADDR_STORAGE to = address(0x7f000001, port).get_sockaddr_storage(&addr_len);
+				utp_connect(s, (const struct sockaddr*)&to, addr_len);
+				sockets.push_back(s);
+			}
+			pump();
+			for (size_t i = sockets.size() - batch; i < sockets.size(); i++) utp_write(sockets[i], payload, 1);
+			pump();
+		}
+		const size_t conns = sockets.size();
+		const size_t rss = rss_bytes() - rss_base, heap = heap_bytes() - heap_base;
+
+		uint64 sweep_ns = 0;
+		const int sweeps = 5;
+		for (int i = 0; i < sweeps; i++) sweep_ns += sweep(ctx[0]) + sweep(ctx[1]);
+		sweep_ns /= sweeps * 2;
+
+		// the busy few, one packet of data in each direction per round
+		memset(&process_hist, 0, sizeof(process_hist));
+		timing = true;
+		for (int r = 0; r < rounds; r++) {
+			for (size_t i = 0; i < active && i < conns; i++) {
+				utp_write(sockets[i * (conns / min(active, conns))], payload, sizeof(payload));
+			}
+			pump();
+		}
+		timing = false;
+
+		printf("%10zu %12zu %12zu %12zu %12.1f %12.3f %10u %10u %10u\n",
+			conns, rss / conns, heap / conns, table_bytes(conns) / conns,
+			sweep_ns / 1000.,
+			// a sweep every 500 ms on each context
+			sweep_ns * 2 * 2 / 1e7,
+			utp_histogram_percentile(&process_hist, 50),
+			utp_histogram_percentile(&process_hist, 99),
+			utp_histogram_percentile(&process_hist, 99.9));
+		fflush(stdout);
+	}
+
+	printf("\nrss/conn and heap/conn cover both ends of a connection, table/sock is\n"
+		"per hash table entry. sweep_us is one utp_check_timeouts pass over one\n"
+		"side's sockets and sweep_cpu%% the share of a core both sides spend on\n"
+		"sweeps every 500 ms. p*_ns are utp_process_udp calls for the %zu busy\n"
+		"connections.\n", active);
+
+	utp_destroy(ctx[0]);
+	utp_destroy(ctx[1]);
+	return 0;
+}
@@ -28,6 +28,7 @@ extern "C" {
 #endif
 
 #include <stdarg.h>
+#include <stddef.h>
 #include "utp_types.h"
 
 typedef struct UTPSocket					utp_socket;
@@ -90,6 +91,10 @@ enum {
 	UTP_SNDBUF,
 	UTP_RCVBUF,
 	UTP_TARGET_DELAY,
+	UTP_CONNECT_TIMEOUT,	// ms a connection may stay in SYN_SENT/SYN_RECV, 0 = no limit
+	UTP_MAX_SOCKETS,		// incoming connections are refused beyond this many sockets, 0 = no limit
+	UTP_EXACT_TIMEOUTS,		// utp_check_timeouts sweeps on every call instead of every 500 ms at most
+	UTP_SOCKET_HISTOGRAMS,	// sockets keep histograms of their own (default), 0 = context totals only
 
 	UTP_ARRAY_SIZE,	// must be last
 };
@@ -124,6 +129,24 @@ typedef uint64 utp_callback_t(utp_callback_arguments *);
 typedef struct {
 	uint32 _nraw_recv[5];	// total packets recieved less than 300/600/1200/MTU bytes fpr all connections (context-wide)
 	uint32 _nraw_send[5];	// total packets sent     less than 300/600/1200/MTU bytes for all connections (context-wide)
+	uint32 syn_accepted;	// incoming connections created
+	uint32 syn_rejected;	// SYNs turned away, including the drop reasons below
+	uint32 drop_too_small;	// datagrams shorter than a uTP header
+	uint32 drop_bad_version;	// datagrams with a header version other than 1
+	uint32 drop_firewall;	// SYNs refused by the firewall callback
+	uint32 drop_conn_limit;	// SYNs refused because the context had too many sockets
+	uint32 drop_invalid_ack;	// packets acking something we never sent
+	uint32 rst_sent;		// RSTs sent in reply to packets for unknown connections
+	uint32 rst_suppressed;	// RSTs not sent because one went out recently or rst_info was full
+	uint64 sweeps;			// timeout sweeps over all sockets
+	uint64 sweep_us;		// total time spent in those sweeps
+	uint32 sweep_max_us;	// longest single sweep
+	uint64 ccontrol_calls;	// congestion control updates timed, see utp_context_set_profile_clock()
+	uint64 ccontrol_ns;		// time they took
+	// refreshed by each utp_get_context_stats() call
+	uint32 nsockets;		// entries in the socket hash
+	uint32 nack_sockets;	// sockets with a deferred ack pending
+	uint32 nrst_info;		// recently sent RSTs remembered
 } utp_context_stats;
 
 // Returned by utp_get_stats()
@@ -136,8 +159,110 @@ typedef struct {
 	uint32 nrecv;		// receive counter (total)
 	uint32 nduprecv;	// duplicate receive counter
 	uint32 mtu_guess;	// Best guess at MTU
+	// snapshot of the congestion state, refreshed by each utp_get_stats() call
+	uint32 rtt;			// smoothed round trip time (ms)
+	uint32 rtt_var;		// round trip time variance (ms)
+	uint32 rto;			// retransmit timeout (ms)
+	uint32 max_window;	// congestion window (bytes)
+	uint32 cur_window;	// bytes in flight
+	uint32 mtu_last;	// last discovered MTU, 0 while probing
+	uint32 delay;		// lowest recent one-way delay we measured (us), 0 before any sample
 } utp_socket_stats;
 
+// Nanosecond clock used to time congestion control while profiling
+typedef uint64 utp_profile_clock_t(void);
+
+// Log-linear histogram of microsecond samples. Values below 8 get a bucket
+// each and every power of two above is split into 8 equal buckets, so a
+// bucket is never wider than 1/8 of the values in it.
+#define UTP_HISTOGRAM_BUCKETS 240
+typedef struct {
+	uint64 count;
+	uint64 sum;
+	uint32 min;
+	uint32 max;
+	uint32 buckets[UTP_HISTOGRAM_BUCKETS];
+} utp_histogram;
+
+// Histograms kept per socket and per context, see utp_get_histogram()
+enum {
+	UTP_HISTOGRAM_RTT = 0,	// round trip of packets sent once (us)
+	UTP_HISTOGRAM_DELAY,	// one-way queuing delay the congestion control acted on (us)
+	UTP_HISTOGRAM_COUNT
+};
+
+// Binary trace of what each socket does, see utp_context_set_trace()
+enum {
+	UTP_TRACE_SEND = 1,		// value: datagram length, flags: packet type
+	UTP_TRACE_RECV,			// value: datagram length, flags: packet type
+	UTP_TRACE_CCONTROL,		// window update after an ack, value: bytes acked
+	UTP_TRACE_RTT,			// value: round trip sample (us)
+	UTP_TRACE_LOSS,			// packet resent after a selective ack, value: its seq_nr
+	UTP_TRACE_FAST_RESEND,	// packet resent after duplicate acks, value: its seq_nr
+	UTP_TRACE_TIMEOUT,		// retransmit timeout fired, value: the timeout (ms)
+	UTP_TRACE_MTU,			// path MTU search moved, value: the MTU now used
+};
+
+// One fixed-size (64 byte) trace record. Everything but time, type, flags
+// and value is the socket's state when the record was written.
+typedef struct {
+	uint64 time;				// us
+	uint32 socket;				// receive connection id
+	uint16 type;				// UTP_TRACE_*
+	uint16 flags;
+	uint16 seq_nr;
+	uint16 ack_nr;
+	uint32 max_window;			// bytes
+	uint32 cur_window;			// bytes in flight
+	uint32 peer_window;			// the window the peer advertised (bytes)
+	uint32 our_delay;			// us
+	uint32 their_delay;			// us
+	uint32 actual_delay;		// last raw one-way delay the peer reported (us)
+	uint32 delay_base;			// us
+	uint32 target_delay;		// us
+	uint32 rtt;					// smoothed (ms)
+	uint16 cur_window_packets;
+	uint16 packet_size;
+	uint32 value;
+} utp_trace_record;
+
+// A ring of trace records in memory the application owns. libutp is the
+// only writer; head counts every record ever written, so the newest one is
+// at (head - 1) % capacity and a reader that saw head move by more than
+// capacity lost records. head is only advanced after the record is written.
+typedef struct {
+	volatile uint64 head;
+	uint32 capacity;
+	uint32 record_size;			// sizeof(utp_trace_record), for decoders
+	utp_trace_record records[1];	// capacity records
+} utp_trace_ring;
+
+// bytes a ring of n records takes
+#define UTP_TRACE_RING_SIZE(n) (offsetof(utp_trace_ring, records) + (n) * sizeof(utp_trace_record))
+
+// A row the application owns and libutp keeps current for one socket, see
+// utp_set_telemetry(). Every field is a double so the rows of many sockets
+// can be laid out in one array and read as a Float64Array. seq is odd while
+// the row is being written.
+typedef struct {
+	double seq;
+	double id;			// never touched by libutp, free for the application
+	double state;		// internal connection state, 0 before the first update
+	double max_window;	// congestion window (bytes)
+	double cur_window;	// bytes in flight
+	double peer_window;	// receive window the peer advertised (bytes)
+	double rtt;			// ms
+	double rtt_var;		// ms
+	double rto;			// ms
+	double delay;		// lowest recent one-way delay we measured (us), 0 before any sample
+	double bytes_recv;
+	double bytes_xmit;
+	double recv_rate;	// bytes/s over the last second or so
+	double xmit_rate;	// bytes/s over the last second or so
+	double rexmit;		// retransmits, fast ones included
+	double updated;		// ms timestamp of the last update
+} utp_socket_telemetry;
+
 #define UTP_IOV_MAX 1024
 
 // For utp_writev, to writes data from multiple buffers
@@ -158,6 +283,7 @@ int				utp_process_udp					(utp_context *ctx, const byte *buf, size_t len, const
 int				utp_process_icmp_error			(utp_context *ctx, const byte *buffer, size_t len, const struct sockaddr *to, socklen_t tolen);
 int				utp_process_icmp_fragmentation	(utp_context *ctx, const byte *buffer, size_t len, const struct sockaddr *to, socklen_t tolen, uint16 next_hop_mtu);
 void			utp_check_timeouts				(utp_context *ctx);
+uint64			utp_next_timeout				(utp_context *ctx);
 void			utp_issue_deferred_acks			(utp_context *ctx);
 utp_context_stats* utp_get_context_stats		(utp_context *ctx);
 utp_socket*		utp_create_socket				(utp_context *ctx);
@@ -172,6 +298,13 @@ int				utp_getpeername					(utp_socket *s, struct sockaddr *addr, socklen_t *add
 void			utp_read_drained				(utp_socket *s);
 int				utp_get_delays					(utp_socket *s, uint32 *ours, uint32 *theirs, uint32 *age);
 utp_socket_stats* utp_get_stats					(utp_socket *s);
+void			utp_set_telemetry				(utp_socket *s, utp_socket_telemetry *row);
+void			utp_context_set_trace			(utp_context *ctx, utp_trace_ring *ring);
+void			utp_context_set_profile_clock	(utp_context *ctx, utp_profile_clock_t *clock);
+utp_histogram*	utp_get_histogram				(utp_socket *s, int which);
+utp_histogram*	utp_context_get_histogram		(utp_context *ctx, int which);
+void			utp_histogram_add				(utp_histogram *h, uint32 value);
+uint32			utp_histogram_percentile		(const utp_histogram *h, double percentile);
 utp_context*	utp_get_context					(utp_socket *s);
 void			utp_close						(utp_socket *s);
 
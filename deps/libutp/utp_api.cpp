@@ -65,11 +65,14 @@ struct_utp_context::struct_utp_context()
 	: userdata(NULL)
 	, current_ms(0)
 	, last_utp_socket(NULL)
+	, trace(NULL)
+	, profile_clock(NULL)
 	, log_normal(false)
 	, log_mtu(false)
 	, log_debug(false)
 {
 	memset(&context_stats, 0, sizeof(context_stats));
+	memset(histograms, 0, sizeof(histograms));
 	memset(callbacks, 0, sizeof(callbacks));
 	target_delay = CCONTROL_TARGET;
 	utp_sockets = new UTPSocketHT;
@@ -89,6 +92,10 @@ struct_utp_context::struct_utp_context()
 	// when setting a download rate limit, all sockets should have
 	// their receive buffer set much lower, to say 60 kiB or so
 	opt_rcvbuf = opt_sndbuf = 1024 * 1024;
+	connect_timeout = 0;
+	max_sockets = 3000;
+	exact_timeouts = false;
+	socket_histograms = true;
 	last_check = 0;
 }
 
@@ -128,7 +135,34 @@ void* utp_context_get_userdata(utp_context *ctx) {
 
 utp_context_stats* utp_get_context_stats(utp_context *ctx) {
 	assert(ctx);
-	return ctx ? &ctx->context_stats : NULL;
+	if (!ctx) return NULL;
+	ctx->context_stats.nsockets = ctx->utp_sockets->GetCount();
+	ctx->context_stats.nack_sockets = ctx->ack_sockets.GetCount();
+	ctx->context_stats.nrst_info = ctx->rst_info.GetCount();
+	return &ctx->context_stats;
+}
+
+void utp_context_set_trace(utp_context *ctx, utp_trace_ring *ring) {
+	assert(ctx);
+	if (!ctx) return;
+	if (ring) {
+		assert(ring->capacity > 0);
+		ring->record_size = sizeof(utp_trace_record);
+	}
+	ctx->trace = ring;
+}
+
+void utp_context_set_profile_clock(utp_context *ctx, utp_profile_clock_t *clock) {
+	assert(ctx);
+	if (!ctx) return;
+	ctx->profile_clock = clock;
+}
+
+utp_histogram* utp_context_get_histogram(utp_context *ctx, int which) {
+	assert(ctx);
+	assert(which >= 0 && which < UTP_HISTOGRAM_COUNT);
+	if (!ctx || which < 0 || which >= UTP_HISTOGRAM_COUNT) return NULL;
+	return &ctx->histograms[which];
 }
 
 ssize_t utp_write(utp_socket *socket, void *buf, size_t len) {
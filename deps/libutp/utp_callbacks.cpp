@@ -23,6 +23,7 @@
  */
 
 #include "utp_callbacks.h"
+#include "utp_probes.h"
 
 int utp_call_on_firewall(utp_context *ctx, const struct sockaddr *address, socklen_t address_len)
 {
@@ -61,6 +62,7 @@ void utp_call_on_connect(utp_context *ctx, utp_socket *socket)
 void utp_call_on_error(utp_context *ctx, utp_socket *socket, int error_code)
 {
 	utp_callback_arguments args;
+	UTP_PROBE2(error, socket, error_code);
 	if (!ctx->callbacks[UTP_ON_ERROR]) return;
 	args.callback_type = UTP_ON_ERROR;
 	args.context = ctx;
@@ -108,6 +110,7 @@ void utp_call_on_delay_sample(utp_context *ctx, utp_socket *socket, int sample_m
 void utp_call_on_state_change(utp_context *ctx, utp_socket *socket, int state)
 {
 	utp_callback_arguments args;
+	UTP_PROBE2(state, socket, state);
 	if (!ctx->callbacks[UTP_ON_STATE_CHANGE]) return;
 	args.callback_type = UTP_ON_STATE_CHANGE;
 	args.context = ctx;
@@ -32,9 +32,18 @@
 #include "utp_packedsockaddr.h"
 #include "utp_internal.h"
 #include "utp_hash.h"
+#include "utp_probes.h"
 
 #define	TIMEOUT_CHECK_INTERVAL	500
 
+// Orders stores to memory another thread may be reading (telemetry rows,
+// the trace ring) so that it can tell a torn or unfinished write.
+#if defined(_MSC_VER)
+#define STORE_BARRIER() MemoryBarrier()
+#else
+#define STORE_BARRIER() __sync_synchronize()
+#endif
+
 // number of bytes to increase max window size by, per RTT. This is
 // scaled down linearly proportional to off_target. i.e. if all packets
 // in one window have 0 delay, window size will increase by this number.
@@ -388,11 +397,59 @@ struct DelayHist {
 		for (size_t i = 0; i < CUR_DELAY_SIZE; i++) {
 			value = min<uint32>(cur_delay_hist[i], value);
 		}
-		// value could be UINT_MAX if we have no samples yet...
+		// clear() zeroes the history, so this is 0 until the first sample
 		return value;
 	}
 };
 
+// index of the bucket value falls into
+static inline int histogram_bucket(uint32 value)
+{
+	if (value < 8) return value;
+	#ifdef __GNUC__
+	const int msb = 31 - __builtin_clz(value);
+	#else
+	int msb = 3;
+	while (value >> (msb + 1)) msb++;
+	#endif
+	return (msb - 2) * 8 + ((value >> (msb - 3)) & 7);
+}
+
+// largest value that falls into bucket i
+static inline uint32 histogram_bucket_max(int i)
+{
+	if (i < 8) return i;
+	const int msb = i / 8 + 2;
+	return ((uint32(8 + i % 8) + 1) << (msb - 3)) - 1;
+}
+
+void utp_histogram_add(utp_histogram *h, uint32 value)
+{
+	assert(h);
+	if (h->count == 0 || value < h->min) h->min = value;
+	if (value > h->max) h->max = value;
+	h->count++;
+	h->sum += value;
+	h->buckets[histogram_bucket(value)]++;
+}
+
+uint32 utp_histogram_percentile(const utp_histogram *h, double percentile)
+{
+	assert(h);
+	if (!h || h->count == 0) return 0;
+	if (percentile <= 0) return h->min;
+	// the sample at this rank, counting from 1
+	uint64 rank = (uint64)(percentile / 100 * h->count + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank >= h->count) return h->max;
+	uint64 seen = 0;
+	for (int i = 0; i < UTP_HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) return min<uint32>(max<uint32>(histogram_bucket_max(i), h->min), h->max);
+	}
+	return h->max;
+}
+
 struct UTPSocket {
 	~UTPSocket();
 
@@ -483,6 +540,8 @@ struct UTPSocket {
 	uint64 rto_timeout;
 	// When the window size is set to zero, start this timer. It will send a new packet every 30secs.
 	uint64 zerowindow_time;
+	// The handshake must complete by then (UTP_CONNECT_TIMEOUT), 0 if unlimited
+	uint64 connect_deadline;
 
 	uint32 conn_seed;
 	// Connection ID for packets I receive
@@ -509,6 +568,17 @@ struct UTPSocket {
 	// that packet
 	uint32 mtu_probe_seq, mtu_probe_size;
 
+	// row kept current for the application, or NULL. the rates are
+	// measured from the byte counters at rate_time
+	utp_socket_telemetry *telemetry;
+	uint64 rate_time;
+	uint64 rate_bytes_recv, rate_bytes_xmit;
+
+	// rtt and queuing delay samples, also added to the context's histograms.
+	// UTP_HISTOGRAM_COUNT of them, allocated at the first sample so an idle
+	// socket doesn't carry them, NULL with UTP_SOCKET_HISTOGRAMS off
+	utp_histogram *histograms;
+
 	// this is the average delay samples, as compared to the initial
 	// sample. It's averaged over 5 seconds
 	int32 average_delay;
@@ -537,10 +607,8 @@ struct UTPSocket {
 
 	SizableCircularBuffer inbuf, outbuf;
 
-	#ifdef _DEBUG
 	// Public per-socket statistics, returned by utp_get_stats()
 	utp_socket_stats _stats;
-	#endif
 
 	// true if we're in slow-start (exponential growth) phase
 	bool slow_start;
@@ -569,6 +637,46 @@ struct UTPSocket {
 		ctx->log_unchecked(this, buf2);
 	}
 
+	// the next record of ctx->trace, prefilled from the socket's state but
+	// for the time. callers check that tracing is on, set the time and
+	// call trace_commit() when done
+	utp_trace_record *trace_begin(uint16 type, uint32 value)
+	{
+		utp_trace_ring *ring = ctx->trace;
+		utp_trace_record *r = &ring->records[ring->head % ring->capacity];
+		r->socket = conn_id_recv;
+		r->type = type;
+		r->flags = 0;
+		r->seq_nr = seq_nr;
+		r->ack_nr = ack_nr;
+		r->max_window = (uint32)max_window;
+		r->cur_window = (uint32)cur_window;
+		r->peer_window = (uint32)max_window_user;
+		r->our_delay = our_hist.get_value();
+		r->their_delay = their_hist.get_value();
+		r->actual_delay = 0;
+		r->delay_base = our_hist.delay_base;
+		r->target_delay = (uint32)target_delay;
+		r->rtt = rtt;
+		r->cur_window_packets = cur_window_packets;
+		r->packet_size = (uint16)get_packet_size();
+		r->value = value;
+		return r;
+	}
+
+	void trace_commit()
+	{
+		STORE_BARRIER();
+		ctx->trace->head++;
+	}
+
+	void trace(uint16 type, uint32 value)
+	{
+		if (!ctx->trace) return;
+		trace_begin(type, value)->time = utp_call_get_microseconds(ctx, this);
+		trace_commit();
+	}
+
 	void schedule_ack();
 
 	// called every time mtu_floor or mtu_ceiling are adjusted
@@ -652,6 +760,8 @@ struct UTPSocket {
 	#endif
 
 	void check_timeouts();
+	uint64 next_timeout();
+	void add_sample(int which, uint32 value);
 	int ack_packet(uint16 seq);
 	size_t selective_ack_bytes(uint base, const byte* mask, byte len, int64& min_rtt);
 	void selective_ack(uint base, const byte *mask, byte len);
@@ -728,10 +838,18 @@ void UTPSocket::send_data(byte* b, size_t length, bandwidth_type_t type, uint32
 
 	last_sent_packet = ctx->current_ms;
 
-	#ifdef _DEBUG
 	_stats.nbytes_xmit += length;
 	++_stats.nxmit;
-	#endif
+	UTP_PROBE6(packet__send, this, conn_id_recv, b1->type(), (uint16)b1->seq_nr, (uint16)b1->ack_nr, length);
+
+	if (ctx->trace) {
+		utp_trace_record *r = trace_begin(UTP_TRACE_SEND, (uint32)length);
+		r->time = time;
+		r->flags = b1->type();
+		r->seq_nr = b1->seq_nr;
+		r->ack_nr = b1->ack_nr;
+		trace_commit();
+	}
 
 	if (ctx->callbacks[UTP_ON_OVERHEAD_STATISTICS]) {
 		size_t n;
@@ -1125,6 +1243,17 @@ void UTPSocket::check_timeouts()
 	switch (state) {
 	case CS_SYN_SENT:
 	case CS_SYN_RECV:
+		// An incoming connection only acks until the first data packet, so its
+		// rto never fires; this bounds the handshake in both directions
+		if (connect_deadline > 0 && (int)(ctx->current_ms - connect_deadline) >= 0) {
+			#if UTP_DEBUG_LOGGING
+			log(UTP_LOG_DEBUG, "Connect timeout in state:%s", statenames[state]);
+			#endif
+			state = CS_RESET;
+			utp_call_on_error(ctx, this, UTP_ETIMEDOUT);
+			return;
+		}
+		// fall through
 	case CS_CONNECTED_FULL:
 	case CS_CONNECTED:
 	case CS_FIN_SENT: {
@@ -1233,6 +1362,8 @@ void UTPSocket::check_timeouts()
 					"max_window:%u cur_window_packets:%d"
 					, seq_nr - cur_window_packets, retransmit_timeout
 					, (uint)max_window, int(cur_window_packets));
+				trace(UTP_TRACE_TIMEOUT, retransmit_timeout);
+				UTP_PROBE4(timeout, this, conn_id_recv, (uint16)(seq_nr - cur_window_packets), retransmit_timeout);
 
 				fast_timeout = true;
 				timeout_seq_nr = seq_nr;
@@ -1285,6 +1416,55 @@ void UTPSocket::check_timeouts()
 	}
 }
 
+// The earliest time (ms) check_timeouts() has something to do for this
+// socket, mirroring the conditions it tests
+uint64 UTPSocket::next_timeout()
+{
+	uint64 next = (uint64)-1;
+
+	switch (state) {
+	case CS_SYN_SENT:
+	case CS_SYN_RECV:
+		if (connect_deadline > 0) next = min(next, connect_deadline);
+		// fall through
+	case CS_CONNECTED_FULL:
+	case CS_CONNECTED:
+	case CS_FIN_SENT:
+		if (max_window_user == 0) next = min(next, zerowindow_time);
+		if (rto_timeout > 0) next = min(next, rto_timeout);
+		if (state == CS_CONNECTED_FULL && !is_full()) next = ctx->current_ms;
+		if (state >= CS_CONNECTED && state < CS_GOT_FIN) next = min<uint64>(next, last_sent_packet + KEEPALIVE_INTERVAL);
+		break;
+
+	case CS_GOT_FIN:
+	case CS_DESTROY_DELAY:
+		next = rto_timeout;
+		break;
+
+	case CS_DESTROY:
+		next = ctx->current_ms;
+		break;
+
+	case CS_UNINITIALIZED:
+	case CS_IDLE:
+	case CS_RESET:
+		break;
+	}
+	return next;
+}
+
+// Adds an rtt or delay sample (us) to the context's histogram and, unless the
+// context keeps totals only, to the socket's own
+void UTPSocket::add_sample(int which, uint32 value)
+{
+	utp_histogram_add(&ctx->histograms[which], value);
+	if (!histograms) {
+		if (!ctx->socket_histograms) return;
+		histograms = (utp_histogram*)calloc(UTP_HISTOGRAM_COUNT, sizeof(utp_histogram));
+	}
+	utp_histogram_add(&histograms[which], value);
+}
+
 // this should be called every time we change mtu_floor or mtu_ceiling
 void UTPSocket::mtu_search_update()
 {
@@ -1309,6 +1489,7 @@ void UTPSocket::mtu_search_update()
 		// Do another search in 30 minutes
 		mtu_discover_time = utp_call_get_milliseconds(this->ctx, this) + 30 * 60 * 1000;
 	}
+	trace(UTP_TRACE_MTU, mtu_last);
 }
 
 void UTPSocket::mtu_reset()
@@ -1357,11 +1538,15 @@ int UTPSocket::ack_packet(uint16 seq)
 	#endif
 
 	outbuf.put(seq, NULL);
+	UTP_PROBE6(packet__acked, this, conn_id_recv, seq, pkt->payload, pkt->transmissions, rtt);
 
 	// if we never re-sent the packet, update the RTT estimate
 	if (pkt->transmissions == 1) {
 		// Estimate the round trip time.
-		const uint32 ertt = (uint32)((utp_call_get_microseconds(this->ctx, this) - pkt->time_sent) / 1000);
+		const uint32 ertt_us = (uint32)(utp_call_get_microseconds(this->ctx, this) - pkt->time_sent);
+		const uint32 ertt = ertt_us / 1000;
+		add_sample(UTP_HISTOGRAM_RTT, ertt_us);
+		trace(UTP_TRACE_RTT, ertt_us);
 		if (rtt == 0) {
 			// First round trip time sample
 			rtt = ertt;
@@ -1591,13 +1776,13 @@ void UTPSocket::selective_ack(uint base, const byte *mask, byte len)
 
 		// used in parse_log.py
 		log(UTP_LOG_NORMAL, "Packet %u lost. Resending", v);
+		trace(UTP_TRACE_LOSS, v);
+		UTP_PROBE3(packet__loss, this, conn_id_recv, v);
 
 		// On Loss
 		back_off = true;
 
-		#ifdef _DEBUG
 		++_stats.rexmit;
-		#endif
 
 		send_packet(pkt);
 		fast_resend_seq_nr = (v + 1) & ACK_NR_MASK;
@@ -1623,6 +1808,7 @@ void UTPSocket::apply_ccontrol(size_t bytes_acked, uint32 actual_delay, int64 mi
 	assert(our_delay >= 0);
 
 	utp_call_on_delay_sample(this->ctx, this, our_delay / 1000);
+	add_sample(UTP_HISTOGRAM_DELAY, our_delay);
 
 	// This test the connection under heavy load from foreground
 	// traffic. Pretend that our delays are very high to force the
@@ -1728,14 +1914,22 @@ void UTPSocket::apply_ccontrol(size_t bytes_acked, uint32 actual_delay, int64 mi
 			average_delay, clock_drift, clock_drift_raw, penalty / 1000,
 			current_delay_sum, current_delay_samples, average_delay_base,
 			uint64(last_maxed_out_window), int(opt_sndbuf), uint64(ctx->current_ms));
+
+	UTP_PROBE6(cwnd, this, conn_id_recv, max_window, cur_window, our_delay, rtt);
+
+	if (ctx->trace) {
+		utp_trace_record *r = trace_begin(UTP_TRACE_CCONTROL, (uint32)bytes_acked);
+		r->time = utp_call_get_microseconds(ctx, this);
+		r->our_delay = our_delay;
+		r->actual_delay = actual_delay;
+		trace_commit();
+	}
 }
 
 static void utp_register_recv_packet(UTPSocket *conn, size_t len)
 {
-	#ifdef _DEBUG
 	++conn->_stats.nrecv;
 	conn->_stats.nbytes_recv += len;
-	#endif
 
 	if (len <= PACKET_SIZE_MID) {
 		if (len <= PACKET_SIZE_EMPTY) {
@@ -1788,6 +1982,15 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 	// mark receipt time
 	uint64 time = utp_call_get_microseconds(conn->ctx, conn);
 
+	if (conn->ctx->trace) {
+		utp_trace_record *r = conn->trace_begin(UTP_TRACE_RECV, (uint32)len);
+		r->time = time;
+		r->flags = pk_flags;
+		r->seq_nr = pk_seq_nr;
+		r->ack_nr = pk_ack_nr;
+		conn->trace_commit();
+	}
+
 	// window packets size is used to calculate a minimum
 	// permissible range for received acks. connections with acks falling
 	// out of this range are dropped
@@ -1804,6 +2007,7 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 	conn->log(UTP_LOG_DEBUG, "Invalid ack_nr: %u. our seq_nr: %u last unacked: %u"
 	, pk_ack_nr, conn->seq_nr, (conn->seq_nr - conn->cur_window_packets) & ACK_NR_MASK);
 #endif
+		conn->ctx->context_stats.drop_invalid_ack++;
 		return 0;
 	}
 
@@ -2136,8 +2340,15 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 	// only apply the congestion controller on acks
 	// if we don't have a delay measurement, there's
 	// no point in invoking the congestion control
-	if (actual_delay != 0 && acked_bytes >= 1)
+	if (actual_delay != 0 && acked_bytes >= 1) {
+		utp_profile_clock_t *clock = conn->ctx->profile_clock;
+		const uint64 start = clock ? clock() : 0;
 		conn->apply_ccontrol(acked_bytes, actual_delay, min_rtt);
+		if (clock) {
+			conn->ctx->context_stats.ccontrol_calls++;
+			conn->ctx->context_stats.ccontrol_ns += clock() - start;
+		}
+	}
 
 	// sanity check, the other end should never ack packets
 	// past the point we've sent
@@ -2267,9 +2478,8 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 					conn->log(UTP_LOG_DEBUG, "Packet %u fast timeout-retry.", conn->seq_nr - conn->cur_window_packets);
 					#endif
 
-					#ifdef _DEBUG
 					++conn->_stats.fastrexmit;
-					#endif
+					conn->trace(UTP_TRACE_FAST_RESEND, conn->fast_resend_seq_nr);
 
 					conn->fast_resend_seq_nr++;
 					conn->send_packet(pkt);
@@ -2439,9 +2649,7 @@ size_t utp_process_incoming(UTPSocket *conn, const byte *packet, size_t len, boo
 		// Has this packet already been received? (i.e. a duplicate)
 		// If that is the case, just discard it.
 		if (conn->inbuf.get(pk_seq_nr) != NULL) {
-			#ifdef _DEBUG
 			++conn->_stats.nduprecv;
-			#endif
 
 			return 0;
 		}
@@ -2508,6 +2716,7 @@ UTPSocket::~UTPSocket()
 	// TODO: The circular buffer should have a destructor
 	free(inbuf.elements);
 	free(outbuf.elements);
+	free(histograms);
 }
 
 void UTP_FreeAll(struct UTPSocketHT *utp_sockets) {
@@ -2589,6 +2798,7 @@ utp_socket*	utp_create_socket(utp_context *ctx)
 	conn->retransmit_timeout	= 0;
 	conn->rto_timeout			= 0;
 	conn->zerowindow_time		= 0;
+	conn->connect_deadline		= 0;
 	conn->average_delay			= 0;
 	conn->current_delay_samples	= 0;
 	conn->cur_window			= 0;
@@ -2623,9 +2833,12 @@ utp_socket*	utp_create_socket(utp_context *ctx)
 
 	memset(conn->extensions, 0, sizeof(conn->extensions));
 
-	#ifdef _DEBUG
 	memset(&conn->_stats, 0, sizeof(utp_socket_stats));
-	#endif
+
+	conn->telemetry = NULL;
+	conn->rate_time = 0;
+	conn->rate_bytes_recv = conn->rate_bytes_xmit = 0;
+	conn->histograms = NULL;
 
 	return conn;
 }
@@ -2661,6 +2874,24 @@ int utp_context_set_option(utp_context *ctx, int opt, int val)
 			assert(val >= 1);
 			ctx->opt_rcvbuf = val;
 			return 0;
+
+		case UTP_CONNECT_TIMEOUT:
+			assert(val >= 0);
+			ctx->connect_timeout = val;
+			return 0;
+
+		case UTP_MAX_SOCKETS:
+			assert(val >= 0);
+			ctx->max_sockets = val;
+			return 0;
+
+		case UTP_EXACT_TIMEOUTS:
+			ctx->exact_timeouts = (val != 0);
+			return 0;
+
+		case UTP_SOCKET_HISTOGRAMS:
+			ctx->socket_histograms = (val != 0);
+			return 0;
 	}
 	return -1;
 }
@@ -2677,6 +2908,10 @@ int utp_context_get_option(utp_context *ctx, int opt)
     	case UTP_TARGET_DELAY:	return ctx->target_delay;
 		case UTP_SNDBUF:		return ctx->opt_sndbuf;
 		case UTP_RCVBUF:		return ctx->opt_rcvbuf;
+		case UTP_CONNECT_TIMEOUT:	return ctx->connect_timeout;
+		case UTP_MAX_SOCKETS:		return ctx->max_sockets;
+		case UTP_EXACT_TIMEOUTS:	return ctx->exact_timeouts ? 1 : 0;
+		case UTP_SOCKET_HISTOGRAMS:	return ctx->socket_histograms ? 1 : 0;
 	}
 	return -1;
 }
@@ -2741,6 +2976,8 @@ int utp_connect(utp_socket *conn, const struct sockaddr *to, socklen_t tolen)
 
 	conn->state = CS_SYN_SENT;
 	conn->ctx->current_ms = utp_call_get_milliseconds(conn->ctx, conn);
+	if (conn->ctx->connect_timeout > 0)
+		conn->connect_deadline = conn->ctx->current_ms + conn->ctx->connect_timeout;
 
 	// Create and send a connect message
 
@@ -2800,6 +3037,43 @@ int utp_connect(utp_socket *conn, const struct sockaddr *to, socklen_t tolen)
 	return 0;
 }
 
+// Refreshes the socket's telemetry row, if it has one
+static void utp_update_telemetry(UTPSocket *conn)
+{
+	utp_socket_telemetry *t = conn->telemetry;
+	if (!t) return;
+
+	const uint64 now = conn->ctx->current_ms;
+	const utp_socket_stats &s = conn->_stats;
+
+	t->seq++;
+	STORE_BARRIER();
+	t->state = conn->state;
+	t->max_window = conn->max_window;
+	t->cur_window = conn->cur_window;
+	t->peer_window = conn->max_window_user;
+	t->rtt = conn->rtt;
+	t->rtt_var = conn->rtt_var;
+	t->rto = conn->rto;
+	t->delay = conn->our_hist.get_value();
+	t->bytes_recv = s.nbytes_recv;
+	t->bytes_xmit = s.nbytes_xmit;
+	t->rexmit = s.rexmit + s.fastrexmit;
+	if (conn->rate_time == 0) {
+		conn->rate_time = now;
+	} else if (now - conn->rate_time >= 1000) {
+		const uint64 elapsed = now - conn->rate_time;
+		t->recv_rate = (s.nbytes_recv - conn->rate_bytes_recv) * 1000.0 / elapsed;
+		t->xmit_rate = (s.nbytes_xmit - conn->rate_bytes_xmit) * 1000.0 / elapsed;
+		conn->rate_time = now;
+		conn->rate_bytes_recv = s.nbytes_recv;
+		conn->rate_bytes_xmit = s.nbytes_xmit;
+	}
+	t->updated = now;
+	STORE_BARRIER();
+	t->seq++;
+}
+
 // Returns 1 if the UDP payload was recognized as a UTP packet, or 0 if it was not
 int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const struct sockaddr *to, socklen_t tolen)
 {
@@ -2818,6 +3092,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 		#if UTP_DEBUG_LOGGING
 		ctx->log(UTP_LOG_DEBUG, NULL, "recv %s len:%u too small", addrfmt(addr, addrbuf), (uint)len);
 		#endif
+		ctx->context_stats.drop_too_small++;
 		return 0;
 	}
 
@@ -2830,6 +3105,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 		ctx->log(UTP_LOG_DEBUG, NULL, "recv %s len:%u version:%u unsupported version", addrfmt(addr, addrbuf), (uint)len, version);
 		#endif
 
+		ctx->context_stats.drop_bad_version++;
 		return 0;
 	}
 
@@ -2839,6 +3115,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 	#endif
 
 	const byte flags = pf1->type();
+	UTP_PROBE4(packet__recv, ctx, id, flags, len);
 
 	if (flags == ST_RESET) {
 		// id is either our recv id or our send id
@@ -2894,6 +3171,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 
 			const size_t read = utp_process_incoming(conn, buffer, len);
 			utp_call_on_overhead_statistics(conn->ctx, conn, false, (len - read) + conn->get_udp_overhead(), header_overhead);
+			utp_update_telemetry(conn);
 			return 1;
 		}
 	}
@@ -2914,6 +3192,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 				ctx->log(UTP_LOG_DEBUG, NULL, "recv not sending RST to non-SYN (stored)");
 				#endif
 
+				ctx->context_stats.rst_suppressed++;
 				return 1;
 			}
 		}
@@ -2924,6 +3203,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 			ctx->log(UTP_LOG_DEBUG, NULL, "recv not sending RST to non-SYN (limit at %u stored)", (uint)ctx->rst_info.GetCount());
 			#endif
 
+			ctx->context_stats.rst_suppressed++;
 			return 1;
 		}
 
@@ -2938,6 +3218,7 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 		r.timestamp = ctx->current_ms;
 
 		UTPSocket::send_rst(ctx, addr, id, seq_nr, utp_call_get_random(ctx, NULL));
+		ctx->context_stats.rst_sent++;
 		return 1;
 	}
 
@@ -2954,15 +3235,18 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 			ctx->log(UTP_LOG_DEBUG, NULL, "rejected incoming connection, connection already exists");
 			#endif
 
+			ctx->context_stats.syn_rejected++;
 			return 1;
 		}
 
-		if (ctx->utp_sockets->GetCount() > 3000) {
+		if (ctx->max_sockets && ctx->utp_sockets->GetCount() > ctx->max_sockets) {
 
 			#if UTP_DEBUG_LOGGING
 			ctx->log(UTP_LOG_DEBUG, NULL, "rejected incoming connection, too many uTP sockets %d", ctx->utp_sockets->GetCount());
 			#endif
 
+			ctx->context_stats.drop_conn_limit++;
+			ctx->context_stats.syn_rejected++;
 			return 1;
 		}
 		// true means yes, block connection.  false means no, don't block.
@@ -2972,16 +3256,21 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 			ctx->log(UTP_LOG_DEBUG, NULL, "rejected incoming connection, firewall callback returned true");
 			#endif
 
+			ctx->context_stats.drop_firewall++;
+			ctx->context_stats.syn_rejected++;
 			return 1;
 		}
 
 		// Create a new UTP socket to handle this new connection
+		ctx->context_stats.syn_accepted++;
 		UTPSocket *conn = utp_create_socket(ctx);
 		utp_initialize_socket(conn, to, tolen, false, id, id+1, id);
 		conn->ack_nr = seq_nr;
 		conn->seq_nr = utp_call_get_random(ctx, NULL);
 		conn->fast_resend_seq_nr = conn->seq_nr;
 		conn->state = CS_SYN_RECV;
+		if (ctx->connect_timeout > 0)
+			conn->connect_deadline = utp_call_get_milliseconds(ctx, conn) + ctx->connect_timeout;
 
 		const size_t read = utp_process_incoming(conn, buffer, len, true);
 
@@ -3003,6 +3292,8 @@ int utp_process_udp(utp_context *ctx, const byte *buffer, size_t len, const stru
 		ctx->log(UTP_LOG_DEBUG, NULL, "rejected incoming connection, UTP_ON_ACCEPT callback not set");
 		#endif
 
+		ctx->context_stats.syn_rejected++;
+
 	}
 
 	return 1;
@@ -3267,10 +3558,11 @@ void utp_check_timeouts(utp_context *ctx)
 
 	ctx->current_ms = utp_call_get_milliseconds(ctx, NULL);
 
-	if (ctx->current_ms - ctx->last_check < TIMEOUT_CHECK_INTERVAL)
+	if (!ctx->exact_timeouts && ctx->current_ms - ctx->last_check < TIMEOUT_CHECK_INTERVAL)
 		return;
 
 	ctx->last_check = ctx->current_ms;
+	const uint64 sweep_start = utp_call_get_microseconds(ctx, NULL);
 
 	for (size_t i = 0; i < ctx->rst_info.GetCount(); i++) {
 		if ((int)(ctx->current_ms - ctx->rst_info[i].timestamp) >= RST_INFO_TIMEOUT) {
@@ -3287,6 +3579,7 @@ void utp_check_timeouts(utp_context *ctx)
 	while ((keyData = ctx->utp_sockets->Iterate(it))) {
 		UTPSocket *conn = keyData->socket;
 		conn->check_timeouts();
+		utp_update_telemetry(conn);
 
 		// Check if the object was deleted
 		if (conn->state == CS_DESTROY) {
@@ -3296,6 +3589,31 @@ void utp_check_timeouts(utp_context *ctx)
 			delete conn;
 		}
 	}
+
+	const uint32 sweep_us = (uint32)(utp_call_get_microseconds(ctx, NULL) - sweep_start);
+	ctx->context_stats.sweeps++;
+	ctx->context_stats.sweep_us += sweep_us;
+	if (sweep_us > ctx->context_stats.sweep_max_us)
+		ctx->context_stats.sweep_max_us = sweep_us;
+}
+
+// When utp_check_timeouts() should next be called (ms, on the context's
+// clock): the earliest socket deadline, and no later than the regular sweep.
+// Looks at every socket, so it is meant for simulations driving a context
+// with UTP_EXACT_TIMEOUTS rather than for every turn of an event loop.
+uint64 utp_next_timeout(utp_context *ctx)
+{
+	assert(ctx);
+	if (!ctx) return (uint64)-1;
+
+	uint64 next = ctx->last_check + TIMEOUT_CHECK_INTERVAL;
+
+	utp_hash_iterator_t it;
+	UTPSocketKeyData* keyData;
+	while ((keyData = ctx->utp_sockets->Iterate(it))) {
+		next = min(next, keyData->socket->next_timeout());
+	}
+	return next;
 }
 
 int utp_getpeername(utp_socket *conn, struct sockaddr *addr, socklen_t *addrlen)
@@ -3427,12 +3745,39 @@ inline bool struct_utp_context::would_log(int level)
 
 utp_socket_stats* utp_get_stats(utp_socket *socket)
 {
-	#ifdef _DEBUG
-		assert(socket);
-		if (!socket) return NULL;
-		socket->_stats.mtu_guess = socket->mtu_last ? socket->mtu_last : socket->mtu_ceiling;
-		return &socket->_stats;
-	#else
-		return NULL;
-	#endif
+	assert(socket);
+	if (!socket) return NULL;
+	socket->_stats.mtu_guess = socket->mtu_last ? socket->mtu_last : socket->mtu_ceiling;
+	socket->_stats.rtt = socket->rtt;
+	socket->_stats.rtt_var = socket->rtt_var;
+	socket->_stats.rto = socket->rto;
+	socket->_stats.max_window = socket->max_window;
+	socket->_stats.cur_window = socket->cur_window;
+	socket->_stats.mtu_last = socket->mtu_last;
+	socket->_stats.delay = socket->our_hist.get_value();
+	return &socket->_stats;
+}
+
+utp_histogram* utp_get_histogram(utp_socket *socket, int which)
+{
+	assert(socket);
+	assert(which >= 0 && which < UTP_HISTOGRAM_COUNT);
+	if (!socket || which < 0 || which >= UTP_HISTOGRAM_COUNT) return NULL;
+	if (!socket->histograms) {
+		// no samples yet, or the context doesn't keep them per socket
+		if (!socket->ctx->socket_histograms) return NULL;
+		socket->histograms = (utp_histogram*)calloc(UTP_HISTOGRAM_COUNT, sizeof(utp_histogram));
+	}
+	return &socket->histograms[which];
+}
+
+void utp_set_telemetry(utp_socket *socket, utp_socket_telemetry *row)
+{
+	assert(socket);
+	if (!socket) return;
+	socket->telemetry = row;
+	socket->rate_time = 0;
+	socket->rate_bytes_recv = socket->_stats.nbytes_recv;
+	socket->rate_bytes_xmit = socket->_stats.nbytes_xmit;
+	utp_update_telemetry(socket);
 }
@@ -124,7 +124,17 @@ struct struct_utp_context {
 	size_t target_delay;
 	size_t opt_sndbuf;
 	size_t opt_rcvbuf;
+	uint32 connect_timeout;
+	uint32 max_sockets;
+	bool exact_timeouts;
+	bool socket_histograms;
 	uint64 last_check;
+	// samples of every socket, see utp_context_get_histogram()
+	utp_histogram histograms[UTP_HISTOGRAM_COUNT];
+	// binary trace ring, NULL while tracing is off
+	utp_trace_ring *trace;
+	// times congestion control into context_stats while set
+	utp_profile_clock_t *profile_clock;
 
 	struct_utp_context();
 	~struct_utp_context();
@@ -0,0 +1,42 @@
+#ifndef __UTP_PROBES_H__
+#define __UTP_PROBES_H__
+
+// USDT (SystemTap / DTrace style) static probes under the provider "libutp".
+// Where <sys/sdt.h> is available each probe is a single nop plus a note in
+// the binary until a tracer such as bpftrace or perf attaches to it, e.g.
+//
+//   bpftrace -e 'usdt:./node-libutp.node:libutp:cwnd { @[arg1] = arg2; }'
+//
+// Anywhere else, or with UTP_DISABLE_PROBES defined, they compile to nothing.
+//
+// Probes and their arguments (socket is the utp_socket pointer, id its
+// receive connection id):
+//   packet__recv	(ctx, id, packet type, length)
+//   packet__send	(socket, id, packet type, seq_nr, ack_nr, length)
+//   packet__acked	(socket, id, seq_nr, payload, transmissions, smoothed rtt ms)
+//   packet__loss	(socket, id, seq_nr)
+//   timeout		(socket, id, oldest unacked seq_nr, retransmit timeout ms)
+//   cwnd			(socket, id, max_window, cur_window, our_delay us, rtt ms)
+//   state			(socket, UTP_STATE_*)
+//   error			(socket, UTP_E*)
+
+#if !defined(UTP_DISABLE_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define UTP_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef UTP_HAVE_PROBES
+#define UTP_PROBE2(name, a, b)					DTRACE_PROBE2(libutp, name, a, b)
+#define UTP_PROBE3(name, a, b, c)				DTRACE_PROBE3(libutp, name, a, b, c)
+#define UTP_PROBE4(name, a, b, c, d)			DTRACE_PROBE4(libutp, name, a, b, c, d)
+#define UTP_PROBE6(name, a, b, c, d, e, f)		DTRACE_PROBE6(libutp, name, a, b, c, d, e, f)
+#else
+#define UTP_PROBE2(name, a, b)					do {} while (0)
+#define UTP_PROBE3(name, a, b, c)				do {} while (0)
+#define UTP_PROBE4(name, a, b, c, d)			do {} while (0)
+#define UTP_PROBE6(name, a, b, c, d, e, f)		do {} while (0)
+#endif
+
+#endif //__UTP_PROBES_H__
@@ -9,6 +9,7 @@ var libutp = require('bindings')('node-libutp.node');
 var utp = module.exports;
 utp.Server = Server;
 utp.Socket = Socket;
+utp.Agent = Agent;
 
 function BlockError (func) {
     return function () {
@@ -21,17 +22,383 @@ function BlockError (func) {
     }
 }
 
+// event types, keep in sync with src/utp.h
+var EVENT_ACCEPT = 0;
+var EVENT_CONNECT = 1;
+var EVENT_READ = 2;
+var EVENT_WRITE = 3;
+var EVENT_END = 4;
+var EVENT_ERROR = 5;
+var EVENT_DESTROY = 6;
+var EVENT_READ_INTO = 7;
+
+// slots of socket.getStats(array), keep in sync with STAT_* in src/utp.h
+var SOCKET_STATS = [
+    'bytesReceived', 'bytesSent', 'packetsReceived', 'packetsSent',
+    'retransmits', 'fastRetransmits', 'duplicates',
+    'rtt', 'rttVar', 'rto', 'maxWindow', 'curWindow', 'mtu', 'delay',
+];
+
+// layout of a trace ring, keep in sync with utp_trace_ring in deps/libutp/utp.h
+var TRACE_HEADER_SIZE = 16;
+var TRACE_RECORD_SIZE = 64;
+
+// percentiles getLatency() reports unless told otherwise
+var LATENCY_PERCENTILES = [50, 90, 99, 99.9];
+
+// connect() options that only a context of its own honours, the shared
+// contexts of an agent are created without them
+var CONTEXT_OPTIONS = ['readCoalesce', 'readPool', 'connectTimeout', 'telemetry', 'socketLatency', 'trace', 'profile'];
+
+// fields of a telemetry row, keep in sync with utp_socket_telemetry in
+// deps/libutp/utp.h; a row is TELEMETRY_FIELDS.length doubles
+var TELEMETRY_FIELDS = [
+    'seq', 'id', 'state', 'maxWindow', 'curWindow', 'peerWindow',
+    'rtt', 'rttVar', 'rto', 'delay', 'bytesReceived', 'bytesSent',
+    'receiveRate', 'sendRate', 'retransmits', 'updated',
+];
+
+var errors = [
+    ['ECONNREFUSED', 'connection refused'],
+    ['ECONNRESET', 'connection reset by peer'],
+    ['ETIMEDOUT', 'connection timed out'],
+];
+
+function UTPError(errcode) {
+    var desc = errors[errcode] || ['UNKNOWN', 'unknown error'];
+    var err = new Error(desc[1]);
+    err.code = desc[0];
+    return err;
+}
+
+// called by the binding once per loop iteration with everything that
+// happened on the context's sockets, `this` is the context handle
+function onEvents(records, chunks, accepted, raw, rawData) {
+    var sockets = this._sockets;
+    // native buffers are never pooled, so the records are always aligned
+    var events = new Uint32Array(records.buffer, records.byteOffset, records.length >> 2);
+    for (var i = 0; i < events.length; i += 3) {
+        var id = events[i], type = events[i + 1], arg = events[i + 2];
+        var handle;
+        if (type === EVENT_ACCEPT) {
+            handle = accepted[arg];
+            sockets.set(id, handle);
+            this._onConnection(handle);
+            continue;
+        }
+        handle = sockets.get(id);
+        if (!handle) continue;
+        try {
+            dispatch(handle._socket, type, arg, chunks);
+        } catch (err) {
+            console.error('Unhandled Exception:');
+            console.error(err.stack);
+        }
+        if (type === EVENT_DESTROY) {
+            sockets.delete(id);
+            // the native wrapper may be pooled and handed to another socket
+            handle._socket = null;
+        }
+    }
+    if (raw && this._onRawMessages) this._onRawMessages(raw, rawData);
+}
+
+// raw (non-utp) datagram records, keep in sync with RawMessage in src/utp.h:
+// uint32 offset, length, port, family, then 16 address bytes
+var RAW_RECORD_SIZE = 32;
+
+function formatAddress(bytes, offset, family) {
+    if (family === 4) {
+        return bytes[offset] + '.' + bytes[offset + 1] + '.' + bytes[offset + 2] + '.' + bytes[offset + 3];
+    }
+    var groups = [];
+    for (var i = 0; i < 16; i += 2) groups.push(((bytes[offset + i] << 8) | bytes[offset + i + 1]).toString(16));
+    // compress the longest run of zero groups, as inet_ntop does
+    var bestStart = -1, bestLength = 0;
+    for (var i = 0; i < 8; i++) {
+        if (groups[i] !== '0') continue;
+        var j = i;
+        while (j < 8 && groups[j] === '0') j++;
+        if (j - i > bestLength) {
+            bestStart = i;
+            bestLength = j - i;
+        }
+        i = j;
+    }
+    if (bestStart === 0 && bestLength === 5 && groups[5] === 'ffff') {
+        return '::ffff:' + formatAddress(bytes, offset + 12, 4);
+    }
+    if (bestLength < 2) return groups.join(':');
+    return groups.slice(0, bestStart).join(':') + '::' + groups.slice(bestStart + bestLength).join(':');
+}
+
+function dispatch(socket, type, arg, chunks) {
+    switch (type) {
+    case EVENT_READ:
+        socket._onRead(chunks[arg]);
+        break;
+    case EVENT_READ_INTO:
+        socket._onReadInto(arg);
+        break;
+    case EVENT_CONNECT:
+        socket._onConnect();
+        break;
+    case EVENT_WRITE:
+        socket._onWrite(arg ? new Error('This socket is closed.') : null);
+        break;
+    case EVENT_END:
+        socket._onEnd();
+        break;
+    case EVENT_ERROR:
+        socket._onError(UTPError(arg));
+        break;
+    case EVENT_DESTROY:
+        socket._onDestroy();
+        break;
+    }
+}
+libutp.setEventHandler(onEvents);
+
+// dns.lookup minus the threadpool round trip for ip literals, and with an
+// optional ttl cache for host names (see utp.setDnsCache)
+var dnsCache = null;
+function lookup(host, callback) {
+    var family = net.isIP(host);
+    if (family) return process.nextTick(callback, null, host, family);
+    if (!dnsCache) return dns.lookup(host, callback);
+    var entry = dnsCache.entries.get(host);
+    if (entry && entry.pending) {
+        // a lookup for this name is already in flight
+        entry.pending.push(callback);
+        return;
+    }
+    if (entry && entry.expires > Date.now()) {
+        return process.nextTick(callback, null, entry.address, entry.family);
+    }
+    var cache = dnsCache;
+    entry = { address: null, family: 0, expires: 0, pending: [callback] };
+    cache.entries.delete(host);
+    cache.entries.set(host, entry);
+    if (cache.entries.size > cache.max) cache.entries.delete(cache.entries.keys().next().value);
+    dns.lookup(host, (err, address, family) => {
+        var pending = entry.pending;
+        entry.pending = null;
+        if (err) {
+            if (cache.entries.get(host) === entry) cache.entries.delete(host);
+        } else {
+            entry.address = address;
+            entry.family = family;
+            entry.expires = Date.now() + cache.ttl;
+        }
+        pending.forEach((cb) => cb(err, address, family));
+    });
+}
+
+function newContext(options) {
+    var handle = new libutp.UTPContext();
+    handle._sockets = new Map();
+    if (options && typeof options.readCoalesce === 'number') handle.setReadCoalesce(options.readCoalesce);
+    if (options && options.readPool === false) handle.setReadPool(false);
+    if (options && typeof options.connectTimeout === 'number') handle.setConnectTimeout(options.connectTimeout);
+    if (options && typeof options.maxConnections === 'number') handle.setMaxConnections(options.maxConnections);
+    if (options && options.socketLatency === false) handle.setSocketLatency(false);
+    if (options && options.telemetry > 0) handle._telemetry = handle.setTelemetry(options.telemetry);
+    if (options && options.trace > 0) setTrace(handle, options.trace);
+    if (options && options.profile) handle.setProfile(true);
+    handle._onClose = () => {};
+    return handle;
+}
+
+function setTrace(handle, records) {
+    handle._trace = handle.setTrace(records > 0 ? records : 0) || null;
+    handle._traceRead = 0;
+}
+
+// copies the records written since the last call out of the trace ring,
+// oldest first; lost counts those overwritten before they were read
+function readTrace(handle) {
+    var ring = handle._trace;
+    if (!ring) return null;
+    var header = new Uint32Array(ring, 0, 4);
+    var head = header[0] + header[1] * 0x100000000;
+    var capacity = header[2];
+    var from = handle._traceRead;
+    var lost = 0;
+    if (head - from > capacity) {
+        lost = head - capacity - from;
+        from = head - capacity;
+    }
+    handle._traceRead = head;
+    var all = Buffer.from(ring, TRACE_HEADER_SIZE, capacity * TRACE_RECORD_SIZE);
+    var start = (from % capacity) * TRACE_RECORD_SIZE;
+    var end = (head % capacity) * TRACE_RECORD_SIZE;
+    var records;
+    if (head === from) records = Buffer.alloc(0);
+    else if (start < end) records = Buffer.from(all.slice(start, end));
+    else records = Buffer.concat([all.slice(start), all.slice(0, end)]);
+    return { records: records, lost: lost };
+}
+
+// multiplexes outgoing connections over a few shared client contexts
+// (one udp socket each) instead of one context per connection
+function Agent(options) {
+    if (!(this instanceof Agent)) return new Agent(options);
+    options = options || {};
+    this.maxSocketsPerContext = options.maxSocketsPerContext > 0 ? options.maxSocketsPerContext : 256;
+    this.maxContexts = options.maxContexts > 0 ? options.maxContexts : Infinity;
+    // idle contexts are closed after this many ms
+    this.idleTimeout = typeof options.idleTimeout === 'number' ? options.idleTimeout : 5000;
+    this._options = options;
+    this._contexts = { 4: [], 6: [] };
+    this._created = 0;
+    this._closed = 0;
+    this._connections = 0;
+}
+
+Agent.prototype._acquire = function (family) {
+    var contexts = this._contexts[family === 4 ? 4 : 6];
+    var context = null;
+    for (var i = 0; i < contexts.length; i++) {
+        var entry = contexts[i]._agentEntry;
+        if (entry.sockets >= this.maxSocketsPerContext) continue;
+        if (!context || entry.sockets < context._agentEntry.sockets) context = contexts[i];
+    }
+    if (!context && contexts.length >= this.maxContexts) {
+        // everything is full, spread the excess evenly
+        context = contexts.reduce((a, b) => a._agentEntry.sockets <= b._agentEntry.sockets ? a : b);
+    }
+    if (!context) {
+        context = newContext(this._options);
+        context.bind(0, family === 4 ? '0.0.0.0' : '::');
+        context._agentEntry = { family: family === 4 ? 4 : 6, sockets: 0, idleTimer: null };
+        contexts.push(context);
+        this._created++;
+    }
+    var entry = context._agentEntry;
+    if (entry.idleTimer) {
+        clearTimeout(entry.idleTimer);
+        entry.idleTimer = null;
+    }
+    entry.sockets++;
+    this._connections++;
+    return context;
+};
+
+Agent.prototype._release = function (context) {
+    var entry = context._agentEntry;
+    if (--entry.sockets > 0) return;
+    entry.idleTimer = setTimeout(() => this._close(context), this.idleTimeout);
+    entry.idleTimer.unref();
+};
+
+Agent.prototype._close = function (context) {
+    var contexts = this._contexts[context._agentEntry.family];
+    var index = contexts.indexOf(context);
+    if (index < 0) return;
+    contexts.splice(index, 1);
+    context._agentEntry.idleTimer = null;
+    context.close();
+    this._closed++;
+};
+
+// closes every context that has no connections right now
+Agent.prototype.destroy = function () {
+    [4, 6].forEach((family) => {
+        this._contexts[family].slice().forEach((context) => {
+            var entry = context._agentEntry;
+            if (entry.sockets > 0) return;
+            if (entry.idleTimer) clearTimeout(entry.idleTimer);
+            this._close(context);
+        });
+    });
+};
+
+Agent.prototype.getStats = function () {
+    var stats = {
+        contexts: 0,
+        idleContexts: 0,
+        sockets: 0,
+        createdContexts: this._created,
+        closedContexts: this._closed,
+        connections: this._connections,
+    };
+    [4, 6].forEach((family) => {
+        this._contexts[family].forEach((context) => {
+            stats.contexts++;
+            stats.sockets += context._agentEntry.sockets;
+            if (context._agentEntry.sockets === 0) stats.idleContexts++;
+        });
+    });
+    return stats;
+};
+
+// { records, lost } as server.readTrace(), over every context of the
+// agent; the records of a context closed while idle are gone with it
+Agent.prototype.readTrace = function () {
+    var records = [], lost = 0, tracing = false;
+    [4, 6].forEach((family) => {
+        this._contexts[family].forEach((context) => {
+            var trace = readTrace(context);
+            if (!trace) return;
+            tracing = true;
+            records.push(trace.records);
+            lost += trace.lost;
+        });
+    });
+    if (!tracing) return null;
+    return { records: Buffer.concat(records), lost: lost };
+};
+
+// server.getProfile() summed over the contexts of an agent created with the
+// profile option, null otherwise; a context closed while idle takes its
+// counts with it
+Agent.prototype.getProfile = function () {
+    if (!this._options.profile) return null;
+    var total = null;
+    [4, 6].forEach((family) => {
+        this._contexts[family].forEach((context) => {
+            var profile = context.getProfile();
+            if (!total) {
+                total = profile;
+                return;
+            }
+            Object.keys(profile).forEach((stage) => {
+                total[stage].calls += profile[stage].calls;
+                total[stage].ns += profile[stage].ns;
+            });
+        });
+    });
+    return total;
+};
+
+utp.globalAgent = new Agent();
+
 function UTPContextFactory(server, handle) {
     server._handle = handle;
     handle._onConnection = BlockError(function (_handle) {
         var socket = new Socket();
-        var connTimer = setTimeout(() => _handle.forceTimedOut(), 29000);
-        UTPSocketFactory(socket, _handle, connTimer);
+        socket._telemetry = handle._telemetry || null;
+        UTPSocketFactory(socket, _handle, server._options.onread);
         server.emit('connection', socket);
     });
-    handle._onUnrecognizedMessage = BlockError(function (msg, rinfo) {
-        server.emit('message', msg, rinfo);
+    // 'messages' gets each batch of non-utp datagrams as is (see
+    // RAW_RECORD_SIZE), 'message' one (msg, rinfo) per datagram like dgram
+    handle._onRawMessages = BlockError(function (raw, rawData) {
+        server.emit('messages', rawData, raw);
+        if (server.listenerCount('message') === 0) return;
+        var words = new Uint32Array(raw.buffer, raw.byteOffset, raw.length >> 2);
+        for (var i = 0; i < raw.length; i += RAW_RECORD_SIZE) {
+            var w = i >> 2;
+            var offset = words[w], length = words[w + 1], port = words[w + 2], family = words[w + 3];
+            server.emit('message', rawData.slice(offset, offset + length), {
+                address: formatAddress(raw, i + 16, family),
+                family: family === 4 ? 'IPv4' : 'IPv6',
+                port: port,
+                size: length,
+            });
+        }
     });
+    handle.setRawMessages(server.listenerCount('message') + server.listenerCount('messages') > 0);
     handle._onClose = BlockError(function () {
         server._handle = null;
         server.emit('close');
@@ -48,7 +415,20 @@ function Server() {
     if (typeof arguments[argIndex] === 'object') var options = arguments[argIndex++];
     if (typeof arguments[argIndex] === 'function') var connectionListener = arguments[argIndex++];
     EventEmitter.call(self);
+    self._options = options || {};
+    // every connection needs a buffer of its own, a shared one would get
+    // the data of several mixed up
+    assert(!self._options.onread || typeof self._options.onread.buffer === 'function');
     if (connectionListener) self.on('connection', connectionListener);
+    // non-utp datagrams are only collected while someone listens for them
+    self.on('newListener', (event) => {
+        if ((event === 'message' || event === 'messages') && self._handle) self._handle.setRawMessages(true);
+    });
+    self.on('removeListener', (event) => {
+        if ((event === 'message' || event === 'messages') && self._handle) {
+            self._handle.setRawMessages(self.listenerCount('message') + self.listenerCount('messages') > 0);
+        }
+    });
     return self;
 };
 util.inherits(Server, EventEmitter);
@@ -73,12 +453,12 @@ Server.prototype.listen = function () {
     if (port === 0) port = parseInt(Math.random() * (65536 - 1024) + 1024);
     assert(port < 65536 && port > 0);
     if (callback) this.once('listening', callback);
-    dns.lookup(host, (err, address, family) => {
+    lookup(host, (err, address, family) => {
         if (err) {
             this.emit('error', err);
         } else {
             try {
-                if (!this._handle) UTPContextFactory(this, new libutp.UTPContext());
+                if (!this._handle) UTPContextFactory(this, newContext(this._options));
                 if (this._handle.state() === 'STATE_INIT') this._handle.bind(port, address);
                 if (this._handle.state() === 'STATE_BOUND') this._handle.listen(backlog);
                 this.emit('listening');
@@ -111,6 +491,63 @@ Server.prototype.address = function () {
     return this._handle.address();
 };
 
+// send raw datagrams through the server's udp socket: bufs is a buffer or
+// an array of them, addrs one address per buffer or a single one for all,
+// each a compact peer buffer (ip + port) or { address, port } with an ip
+// literal; returns how many were sent or queued
+Server.prototype.send = function (bufs, addrs) {
+    if (!this._handle || this._handle.state() !== 'STATE_BOUND') throw new Error('Not running');
+    if (!Array.isArray(bufs)) bufs = [bufs];
+    if (!Array.isArray(addrs)) addrs = [addrs];
+    return this._handle.sendRaw(bufs, addrs);
+};
+
+Server.prototype.getStats = function () {
+    if (!this._handle) return null;
+    return this._handle.getStats();
+};
+
+// rtt and queuing delay over all connections so far, in microseconds;
+// reset starts the histograms over after reading them
+Server.prototype.getLatency = function (percentiles, reset) {
+    if (!this._handle) return null;
+    return this._handle.getLatency(percentiles || LATENCY_PERCENTILES, !!reset);
+};
+
+// times each stage of the context's pipeline until profile(false); turning
+// it on starts the counts over
+Server.prototype.profile = function (enable) {
+    if (this._handle) this._handle.setProfile(enable !== false);
+    return this;
+};
+
+// { recv, process, ccontrol, dispatch, timeouts, send }, each { calls, ns }
+Server.prototype.getProfile = function () {
+    if (!this._handle) return null;
+    return this._handle.getProfile();
+};
+
+// traces what every connection does into a ring of that many records,
+// 0 stops tracing
+Server.prototype.trace = function (records) {
+    if (!this._handle) return this;
+    setTrace(this._handle, records);
+    return this;
+};
+
+// { records, lost }: a Buffer of the 64 byte trace records written since the
+// last call, for deps/libutp/parse_trace; null while not tracing
+Server.prototype.readTrace = function () {
+    if (!this._handle) return null;
+    return readTrace(this._handle);
+};
+
+// the context's telemetry table, null unless created with options.telemetry
+Server.prototype.getTelemetry = function () {
+    if (!this._handle) return null;
+    return this._handle._telemetry || null;
+};
+
 Server.prototype.unref = function () {
     this._handle.unref();
     return this;
@@ -132,45 +569,37 @@ function Socket() {
     return self;
 };
 
-function UTPSocketFactory(socket, handle, timer) {
+// handles only point back at their socket, the event handlers live on the
+// prototype so a connection costs no closures
+function UTPSocketFactory(socket, handle, onread) {
     socket._handle = handle;
-    var had_error = false;
-    handle._onConnect = BlockError(function () {
-        if (timer) clearTimeout(timer);
-        if (socket._cachedChunk) {
-            handle.write(socket._cachedChunk, (err) => {
-                socket._cachedCallback(err);
-                delete socket._cachedCallback;
-            });
-            delete socket._cachedChunk;
-        }
-        socket.emit('connect');
-    });
-    handle._onEnd = BlockError(function () {
-        socket.push(null);
-    });
-    handle._onError = BlockError(function (err) {
-        had_error = true;
-        socket.emit('error', err);
-    });
-    handle._onDestroy = BlockError(function () {
-        if (socket._contextAutoClose) socket._context.close();
-        socket._handle = null;
-        socket._context = null;
-        socket._closed = true;
-        socket.emit('close', had_error);
-    });
-    handle._onRead = BlockError(function (buf) {
-        if (!socket.push(buf)) ;//handle.slow();
-    });
+    handle._socket = socket;
+    // onread: { buffer, callback } as in net.connect, payloads are copied
+    // straight into buffer and callback(nread, buffer) is called instead of
+    // emitting 'data'; returning false holds the buffer until resume()
+    if (onread) {
+        var buffer = typeof onread.buffer === 'function' ? onread.buffer() : onread.buffer;
+        assert(buffer instanceof Uint8Array && buffer.length > 0);
+        assert(typeof onread.callback === 'function');
+        handle.setReadInto(buffer);
+        socket._readIntoBuffer = buffer;
+        socket._readIntoCallback = onread.callback;
+    }
 }
 
 Socket.prototype = {
     _readLimit: 0,
     _handle: null,
+    _writeCallback: null,
     _context: null,
     _contextAutoClose: false,
+    _agent: null,
+    _telemetry: null,
     _closed: true,
+    _hadError: false,
+    _readIntoBuffer: null,
+    _readIntoCallback: null,
+    _readIntoPaused: false,
 };
 util.inherits(Socket, stream.Duplex);
 
@@ -180,7 +609,10 @@ Socket.prototype._write = function (chunk, encoding, callback) {
     else if (!this._handle) {
         this._cachedChunk = chunk;
         this._cachedCallback = callback;
-    } else this._handle.write(chunk, callback);
+    } else {
+        this._writeCallback = callback;
+        this._handle.write(chunk);
+    }
 };
 /*
 Socket.prototype._writev = function (chunks, callback) {
@@ -193,7 +625,66 @@ Socket.prototype._writev = function (chunks, callback) {
 };
 */
 Socket.prototype._read = function (size) {
-    //handle.normal();
+    if (this._handle && !this._readIntoBuffer) this._handle.readDrained(this._readableState.length);
+};
+Socket.prototype.resume = function () {
+    if (this._readIntoPaused && this._handle) {
+        this._readIntoPaused = false;
+        this._onReadInto(this._handle.readIntoDone());
+    }
+    return stream.Duplex.prototype.resume.call(this);
+};
+
+Socket.prototype._onConnect = function () {
+    if (this._cachedChunk) {
+        this._writeCallback = this._cachedCallback;
+        this._handle.write(this._cachedChunk);
+        delete this._cachedChunk;
+        delete this._cachedCallback;
+    }
+    this.emit('connect');
+};
+Socket.prototype._onWrite = function (err) {
+    var callback = this._writeCallback;
+    this._writeCallback = null;
+    if (callback) callback(err);
+};
+Socket.prototype._onEnd = function () {
+    this.push(null);
+};
+Socket.prototype._onError = function (err) {
+    this._hadError = true;
+    this.emit('error', err);
+};
+Socket.prototype._onDestroy = function () {
+    if (this._contextAutoClose) this._context.close();
+    if (this._agent) this._agent._release(this._context);
+    this._agent = null;
+    this._handle = null;
+    this._context = null;
+    this._closed = true;
+    this.emit('close', this._hadError);
+};
+Socket.prototype._onRead = function (buf) {
+    if (this._readIntoBuffer) {
+        // an accepted socket may have received data before the buffer was
+        // set, it goes through the buffer like anything later
+        this._handle.spillReadInto(buf);
+        if (!this._readIntoPaused) this._onReadInto(this._handle.readIntoDone());
+        return;
+    }
+    // the native side counts the pushed bytes against the receive window,
+    // so a full readable buffer simply shrinks what we advertise
+    this.push(buf);
+};
+Socket.prototype._onReadInto = function (nread) {
+    while (nread > 0) {
+        if (this._readIntoCallback(nread, this._readIntoBuffer) === false) {
+            this._readIntoPaused = true;
+            return;
+        }
+        nread = this._handle.readIntoDone();
+    }
 };
 Socket.prototype.end = function (chunk, encoding) {
     stream.Duplex.prototype.end.call(this, chunk, encoding, () => this._handle.close());
@@ -201,11 +692,12 @@ Socket.prototype.end = function (chunk, encoding) {
 
 
 Socket.prototype.connect = function () {
-    var port, host = '::1', localPort = 0, localAddress = '::', connectListener, context;
+    var port, host = '::1', localPort = 0, localAddress = '::', connectListener, context, options;
     if (typeof arguments[0] === 'object') {
-        var options = arguments[0];
+        options = arguments[0];
         if (typeof options.port === 'number') port = options.port;
-        if (typeof options.host === 'string') host = options.host;
+        // a 4 or 16 byte buffer is taken as a packed address (compact peer format)
+        if (typeof options.host === 'string' || Buffer.isBuffer(options.host)) host = options.host;
         if (typeof options.localPort === 'number') localPort = options.localPort;
         if (typeof options.localAddress === 'string') localAddress = options.localAddress;
         if (options.server instanceof Server) context = options.server._handle;
@@ -217,25 +709,44 @@ Socket.prototype.connect = function () {
         if (typeof arguments[argIndex] === 'function') connectListener = arguments[argIndex++];
     }
     localPort = localPort | 0;
+    // the cap only refuses incoming connections, a client has none to refuse
+    assert(!options || options.maxConnections === undefined);
+    // a fixed local port or per-context settings need a context of their own
+    var agent = utp.globalAgent;
+    if (options && options.agent !== undefined) agent = options.agent;
+    else if (localPort !== 0 || (options && CONTEXT_OPTIONS.some((name) => options[name] !== undefined))) agent = null;
     if (localPort === 0) localPort = parseInt(Math.random() * (65536 - 16384) + 16384);
     assert(typeof port === 'number' && port < 65536 && port > 0);
     assert(localPort < 65536 && localPort > 0);
     this._closed = false;
     if (connectListener) this.on('connect', connectListener);
-    dns.lookup(host, (err, address, family) => {
+    var resolve = Buffer.isBuffer(host) ?
+        (callback) => process.nextTick(callback, null, host, host.length === 4 ? 4 : 6) :
+        (callback) => lookup(host, callback);
+    resolve((err, address, family) => {
         if (err) {
             this.emit('error', err);
         } else {
             try {
-                if (!context) {
-                    context = new libutp.UTPContext();
+                if (!context && agent) {
+                    context = agent._acquire(family);
+                    this._agent = agent;
+                } else if (!context) {
+                    context = newContext(options);
                     context._onError = (err) => this.emit('error', err);
                     context.bind(localPort, family === 4 ? '0.0.0.0' : '::');
                     this._contextAutoClose = true;
                 }
                 this._context = context;
-                UTPSocketFactory(this, context.connect(port, address));
+                this._telemetry = context._telemetry || null;
+                var handle = Buffer.isBuffer(address) ? context.connectPacked(port, address) : context.connect(port, address);
+                context._sockets.set(handle._id, handle);
+                UTPSocketFactory(this, handle, options && options.onread);
             } catch (err) {
+                if (this._agent && !this._handle) {
+                    this._agent._release(context);
+                    this._agent = null;
+                }
                 this.emit('error', err);
             }
         }
@@ -258,6 +769,50 @@ Socket.prototype.address = function () {
     else return this._context.address();
 };
 
+// fills out (a Float64Array of utp.SOCKET_STATS.length slots) and returns it,
+// or returns a fresh object keyed by the slot names when out is omitted;
+// null once the connection is gone
+Socket.prototype.getStats = function (out) {
+    if (out && !(out instanceof Float64Array && out.length >= SOCKET_STATS.length))
+        throw new TypeError('getStats needs a Float64Array of ' + SOCKET_STATS.length + ' slots');
+    if (!this._handle) return null;
+    var arr = out || new Float64Array(SOCKET_STATS.length);
+    if (!this._handle.getStats(arr)) return null;
+    if (out) return out;
+    var res = {};
+    for (var i = 0; i < SOCKET_STATS.length; i++) res[SOCKET_STATS[i]] = arr[i];
+    return res;
+};
+
+// rtt and queuing delay of this connection, in microseconds
+Socket.prototype.getLatency = function (percentiles) {
+    if (!this._handle) return null;
+    return this._handle.getLatency(percentiles || LATENCY_PERCENTILES);
+};
+
+// server.getProfile() for a connection that has a context of its own
+// (connect() with the profile option); null otherwise
+Socket.prototype.getProfile = function () {
+    if (!this._context || !this._contextAutoClose) return null;
+    return this._context.getProfile();
+};
+
+// the trace of a connection that has a context of its own (connect() with
+// the trace option), as server.readTrace(); null otherwise
+Socket.prototype.readTrace = function () {
+    if (!this._context || !this._contextAutoClose) return null;
+    return readTrace(this._context);
+};
+
+// { buffer, row } locating this connection in its context's telemetry
+// table, null if it has no row
+Socket.prototype.getTelemetry = function () {
+    if (!this._handle || !this._telemetry) return null;
+    var row = this._handle.telemetryRow();
+    if (row < 0) return null;
+    return { buffer: this._telemetry, row: row };
+};
+
 Object.defineProperty(Socket.prototype, 'remoteAddress', {
     enumerable: true,
     get: function () {
@@ -289,6 +844,38 @@ Object.defineProperty(Socket.prototype, 'remotePort', {
 });
 
 utp.createServer = utp.Server.bind(null);
+utp.SOCKET_STATS = SOCKET_STATS;
+utp.TELEMETRY_FIELDS = TELEMETRY_FIELDS;
+
+// return the memory behind a received buffer to the read pool before it is
+// collected; the buffer must not be used afterwards
+utp.releaseBuffer = function (buf) {
+    return libutp.releaseBuffer(buf);
+};
+utp.readPoolStats = function () {
+    return libutp.readPoolStats();
+};
+// cache host name lookups for options.ttl ms (default 60000), keeping at
+// most options.max names (default 1000); setDnsCache(null) turns it off
+utp.setDnsCache = function (options) {
+    if (!options) {
+        dnsCache = null;
+        return;
+    }
+    dnsCache = {
+        ttl: typeof options.ttl === 'number' ? options.ttl : 60000,
+        max: options.max > 0 ? options.max : 1000,
+        entries: new Map(),
+    };
+};
+// native socket wrappers waiting for reuse and how often that paid off
+utp.socketPoolStats = function () {
+    return libutp.socketPoolStats();
+};
+// wakeups of the shared timeout timer, idleWakeups found no connection to serve
+utp.timerStats = function () {
+    return libutp.timerStats();
+};
 utp.connect = utp.createConnection = function () {
     var socket = new Socket();
     socket.connect.apply(socket, arguments);
@@ -8,6 +8,10 @@ void InitAll(v8::Local<v8::Object> exports, v8::Local<v8::Object> module) {
     UTPContext::Init(exports, module);
     UTPSocket::Init(exports, module);
     exports->Set(Nan::New("cleanup").ToLocalChecked(), Nan::New<v8::FunctionTemplate>(UTPSocket::CleanUp)->GetFunction());
+    exports->Set(Nan::New("releaseBuffer").ToLocalChecked(), Nan::New<v8::FunctionTemplate>(ReadPool::Release)->GetFunction());
+    exports->Set(Nan::New("readPoolStats").ToLocalChecked(), Nan::New<v8::FunctionTemplate>(ReadPool::Stats)->GetFunction());
+    exports->Set(Nan::New("socketPoolStats").ToLocalChecked(), Nan::New<v8::FunctionTemplate>(UTPSocket::PoolStats)->GetFunction());
+    exports->Set(Nan::New("timerStats").ToLocalChecked(), Nan::New<v8::FunctionTemplate>(TimerService::Stats)->GetFunction());
 }
 
 }
@@ -14,8 +14,14 @@ extern "C" {
 #include <node_object_wrap.h>
 #include <nan.h>
 #include <unordered_set>
+#include <unordered_map>
+#include <map>
+#include <vector>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
 #include <memory>
 #include <functional>
 #include <algorithm>
@@ -30,10 +36,148 @@ using std::function;
 using std::vector;
 using std::nothrow;
 using std::unordered_set;
+using std::unordered_map;
+using std::multimap;
 
 class UTPContext;
 class UTPSocket;
 
+// socket events queued while libutp runs and handed to js in one batch
+enum {
+    EVENT_ACCEPT = 0, // arg: index into the accepted handles array
+    EVENT_CONNECT,
+    EVENT_READ,       // arg: index into the read chunks array
+    EVENT_WRITE,      // arg: 0 on success, 1 if the socket closed first
+    EVENT_END,
+    EVENT_ERROR,      // arg: libutp error code
+    EVENT_DESTROY,
+    EVENT_READ_INTO   // arg: bytes copied into the socket's own read buffer
+};
+
+struct Event {
+    uint32_t id;
+    uint32_t type;
+    uint32_t arg;
+};
+
+// a datagram that is not uTP, the payload is at offset in the batch's
+// combined buffer and address holds the raw 4 or 16 bytes
+struct RawMessage {
+    uint32_t offset;
+    uint32_t length;
+    uint32_t port;
+    uint32_t family; // 4 or 6
+    uint8_t address[16];
+};
+
+// datagrams through a context's udp socket, utp and raw traffic apart
+struct TransportStats {
+    uint64_t utpSent;
+    uint64_t utpSentBytes;
+    uint64_t utpReceived;
+    uint64_t utpReceivedBytes;
+    uint64_t rawSent;
+    uint64_t rawSentBytes;
+    uint64_t rawReceived;
+    uint64_t rawReceivedBytes;
+    uint64_t queuedSends; // had to wait in libuv's queue
+    uint64_t sendErrors;
+};
+
+// stages of a context's pipeline timed while profiling; they nest, a
+// datagram's processing includes the acks sent in reply
+enum {
+    STAGE_RECV = 0,  // each datagram libuv hands over, processing included
+    STAGE_PROCESS,   // utp_process_udp
+    STAGE_DISPATCH,  // handing a batch of events to js
+    STAGE_TIMEOUTS,  // utp_check_timeouts
+    STAGE_SEND,      // sending a datagram, the syscall included
+    STAGE_COUNT
+};
+
+struct StageTime {
+    uint64_t calls;
+    uint64_t ns;
+};
+
+// a datagram the socket could not take right away
+struct SendRequest {
+    uv_udp_send_t req;
+    unique_ptr<char[]> data;
+};
+
+/*
+ * Fixed-size blocks that received payloads are copied into exactly once.
+ * A context fills its current block from front to back with the chunks of
+ * all its sockets and every chunk is handed to js as an external buffer
+ * over a slice of it. A block is reused once the context moved on and every
+ * slice was either collected or released explicitly, so idle sockets hold
+ * no memory.
+ */
+class ReadPool final {
+public:
+    static const size_t BLOCK_SIZE = 65536;
+    static const size_t MAX_FREE_BLOCKS = 64;
+
+    struct Block {
+        char *data;
+        size_t used;
+        // context filling it + open chunks + slices not released yet; the
+        // block is reusable at zero
+        unsigned refs;
+        // slices not collected yet; the memory must stay valid until zero
+        unsigned pins;
+        bool dead;
+    };
+    struct Slice {
+        Block *block;
+        bool released;
+    };
+
+    static Block *acquire();
+    static void unref(Block *block);
+    static Slice *slice(Block *block, char *data);
+    static v8::Local<v8::Object> wrap(char *data, size_t len, Slice *slice);
+    static bool release(char *data);
+
+    static NAN_METHOD(Release);
+    static NAN_METHOD(Stats);
+private:
+    static vector<Block *> freeBlocks;
+    static unordered_map<char *, Slice *> slices;
+    static size_t totalBlocks;
+    static void onFree(char *data, void *hint);
+};
+
+/*
+ * One timer for all contexts of the loop. A context registers when it gets
+ * its first connection and is re-armed after each check for as long as it
+ * still has some, so a process full of idle contexts never wakes up.
+ */
+class TimerService final {
+public:
+    static void schedule(UTPContext *utpctx, uint64_t delay);
+    static void cancel(UTPContext *utpctx);
+
+    static NAN_METHOD(Stats);
+private:
+    static uv_timer_t timer;
+    static bool initialized;
+    static multimap<uint64_t, UTPContext *> deadlines;
+    static unordered_map<UTPContext *, multimap<uint64_t, UTPContext *>::iterator> scheduled;
+    static uint64_t wakeups;
+    static uint64_t idleWakeups;
+    static uint64_t checks;
+    static void arm();
+    static void onTimer(uv_timer_t *handle);
+};
+
+struct ReadChunk {
+    char *data;
+    size_t len;
+    ReadPool::Slice *slice; // null if data was malloc'ed for this chunk alone
+};
+
 class UTPContext final : public Nan::ObjectWrap {
 public:
     enum {
@@ -42,11 +186,15 @@ public:
         STATE_STOPPED
     };
     static const char *statestr[];
+    // matches TIMEOUT_CHECK_INTERVAL in libutp
+    static const uint64_t TIMEOUT_INTERVAL = 500;
+    static const int CONNECT_TIMEOUT = 29000;
 private:
 	static Nan::Persistent<v8::Function> constructor;
+	static Nan::Persistent<v8::Function> eventHandler;
 
 	uv_udp_t udpHandle;
-	uv_timer_t timerHandle;
+	uv_check_t checkHandle;
 	unique_ptr<utp_context, function<void (utp_context *)>> ctx;
 	int state;
 	bool listening;
@@ -56,8 +204,49 @@ private:
     int refCount;
     bool refSelf;
 
+    vector<Event> events;
+    vector<ReadChunk> readChunks;
+    vector<UTPSocket *> reading;
+    size_t readCoalesce;
+    bool readPool;
+    // pool block the chunks of this pass are cut from
+    ReadPool::Block *readBlock;
+    vector<UTPSocket *> accepted;
+    vector<UTPSocket *> released;
+    bool flushing;
+    bool closing;
+    int pendingCloses;
+
+    bool rawMessages;
+    vector<RawMessage> rawRecords;
+    vector<char> rawPayload;
+    TransportStats transportStats;
+
+    // one row per socket, kept current by libutp and shared with js
+    Nan::Persistent<v8::Object> telemetryBuffer;
+    utp_socket_telemetry *telemetryRows;
+    vector<uint32_t> telemetryFree;
+
+    // binary trace ring libutp writes into while tracing is on
+    Nan::Persistent<v8::Object> traceBuffer;
+
+    bool profiling;
+    StageTime stages[STAGE_COUNT];
+    // 0 while not profiling, so stageEnd() knows to skip
+    uint64_t stageStart() const { return profiling ? uv_hrtime() : 0; }
+    void stageEnd(int stage, uint64_t start) {
+        if (!start) return;
+        stages[stage].calls++;
+        stages[stage].ns += uv_hrtime() - start;
+    }
+    static uint64 profileClock() { return uv_hrtime(); }
+
 	void uvRecv(ssize_t len, const void *buf, const struct sockaddr *addr, unsigned flags);
+	static bool isUTPHeader(const unsigned char *data, size_t len);
+	void queueRaw(const unsigned char *data, size_t len, const struct sockaddr *addr);
 	uint64 sendTo(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen);
+	int sendDatagram(const char *data, size_t len, const struct sockaddr *addr, bool raw);
+	static int parseAddress(v8::Local<v8::Value> value, struct sockaddr_storage *addr);
 	bool onFirewall();
 	void onAccept(utp_socket *sock);
 
@@ -66,8 +255,10 @@ private:
     int bind(uint16_t port, string host);
     void listen(int _backlog);
     int connect(uint16_t port, string host, UTPSocket **putpsock);
+    void connect(const struct sockaddr *addr, socklen_t addrlen, UTPSocket **putpsock);
     void stop();
     void destroy();
+    static void onHandleClosed(uv_handle_t *handle);
 
     void uvRef();
     void uvUnref();
@@ -76,11 +267,25 @@ private:
 	static NAN_METHOD(Bind);
 	static NAN_METHOD(Listen);
 	static NAN_METHOD(Connect);
+	static NAN_METHOD(ConnectPacked);
 	static NAN_METHOD(Close);
     static NAN_METHOD(State);
     static NAN_METHOD(Address);
 	static NAN_METHOD(jsRef);
 	static NAN_METHOD(jsUnref);
+	static NAN_METHOD(SetReadCoalesce);
+	static NAN_METHOD(SetReadPool);
+	static NAN_METHOD(SetConnectTimeout);
+	static NAN_METHOD(SetMaxConnections);
+	static NAN_METHOD(SetSocketLatency);
+	static NAN_METHOD(SetRawMessages);
+	static NAN_METHOD(SendRaw);
+	static NAN_METHOD(GetStats);
+	static NAN_METHOD(SetTelemetry);
+	static NAN_METHOD(GetLatency);
+	static NAN_METHOD(SetTrace);
+	static NAN_METHOD(SetProfile);
+	static NAN_METHOD(GetProfile);
 
 public:
 	static void Init(v8::Local<v8::Object> exports, v8::Local<v8::Object> module);
@@ -88,43 +293,119 @@ public:
 	~UTPContext();
     void sockRef();
     void sockUnref();
+    void queueEvent(UTPSocket *utpsock, uint32_t type, uint32_t arg = 0);
+    uint32_t queueRead(UTPSocket *utpsock);
+    uint32_t queueReadInto(UTPSocket *utpsock);
+    void setEventArg(uint32_t index, uint32_t arg) { events[index].arg = arg; }
+    void setReadChunk(uint32_t index, char *data, size_t len, ReadPool::Slice *slice) { readChunks[index] = {data, len, slice}; }
+    size_t readCoalesceSize() const { return readCoalesce; }
+    ReadPool::Block *fillBlock();
+    bool readPoolEnabled() const { return readPool; }
+    utp_socket_telemetry *acquireTelemetryRow(int32_t *index);
+    void releaseTelemetryRow(int32_t index);
+    void releaseSocket(UTPSocket *utpsock);
+    void flushEvents();
+    bool checkTimeouts();
+
+    // { rtt, delay } each summarized with the given percentiles
+    static v8::Local<v8::Object> latencyObject(utp_histogram *rtt, utp_histogram *delay, v8::Local<v8::Value> percentiles);
+
+    static NAN_METHOD(SetEventHandler);
 };
 
 class UTPSocket final : public Nan::ObjectWrap {
 private:
     static unordered_set<utp_socket *> activeSockets;
 	static Nan::Persistent<v8::Function> constructor;
+	static uint32_t nextId;
+	// released wrappers kept with their js handle for the next connection
+	static vector<UTPSocket *> pool;
+	static const size_t MAX_POOLED = 256;
+	static uint64_t created;
+	static uint64_t reused;
 
-	UTPContext *const utpctx;
+	UTPContext *utpctx;
+	uint32_t id;
 	utp_socket *sock;
 	unique_ptr<char[]> chunk;
     size_t chunkLength;
 	size_t chunkOffset;
-    Nan::Callback writeCb;
 	bool connected;
 
-    bool paused;
-    unique_ptr<char[]> readBuf;
+    // bytes handed to js but not yet consumed by the readable stream
     size_t readLen;
+    // in-order bytes collected during the current pass, handed to js as one buffer
+    char *readChunk;
+    size_t readChunkLength;
+    size_t readChunkCapacity;
+    size_t readChunkLimit;
+    uint32_t readChunkIndex;
+    // pool block the open chunk is in, referenced until it is sealed
+    ReadPool::Block *readBlock;
+    bool readChunkPooled;
+
+    // caller-owned buffer reads are copied into instead (onread option)
+    Nan::Persistent<v8::Object> readIntoBuffer;
+    char *readIntoData;
+    size_t readIntoLength;
+    size_t readIntoFilled;
+    uint32_t readIntoEvent;
+    bool readIntoQueued; // EVENT_READ_INTO queued, the buffer still fills up
+    bool readIntoHeld;   // js owns the buffer until readIntoDone()
+    // bytes that did not fit while the buffer was full or held
+    vector<char> readSpill;
+    size_t readSpillOffset;
+
+    // row in the context's telemetry table, -1 if none
+    int32_t telemetryRow;
 
     bool refSelf;
 
-    void setChunk(unique_ptr<char[]>&& _chunk, size_t len, v8::Local<v8::Function> cb);
+    void setChunk(unique_ptr<char[]>&& _chunk, size_t len);
     void write();
 
     void uvRef();
     void uvUnref();
 
+    UTPSocket();
+    void attach(UTPContext *_utpctx, utp_socket *_sock);
+    void reset();
+
 	static NAN_METHOD(New);
 	static NAN_METHOD(Write);
 	static NAN_METHOD(Close);
 	static NAN_METHOD(ForceTimedOut);
 	static NAN_METHOD(SlowSpeed);
 	static NAN_METHOD(NormalSpeed);
+	static NAN_METHOD(ReadDrained);
+	static NAN_METHOD(SetReadInto);
+	static NAN_METHOD(ReadIntoDone);
+	static NAN_METHOD(SpillReadInto);
 	static NAN_METHOD(RemoteAddress);
+	static NAN_METHOD(GetStats);
+	static NAN_METHOD(TelemetryRow);
+	static NAN_METHOD(GetLatency);
 	static NAN_METHOD(jsRef);
 	static NAN_METHOD(jsUnref);
 public:
+    // slots filled by getStats(), in the order of SOCKET_STATS in lib/utp.js
+    enum {
+        STAT_BYTES_RECEIVED = 0,
+        STAT_BYTES_SENT,
+        STAT_PACKETS_RECEIVED,
+        STAT_PACKETS_SENT,
+        STAT_RETRANSMITS,
+        STAT_FAST_RETRANSMITS,
+        STAT_DUPLICATES,
+        STAT_RTT,
+        STAT_RTT_VAR,
+        STAT_RTO,
+        STAT_MAX_WINDOW,
+        STAT_CUR_WINDOW,
+        STAT_MTU,
+        STAT_DELAY,
+        STAT_COUNT
+    };
     static void Init(v8::Local<v8::Object> exports, v8::Local<v8::Object> module);
 	static UTPSocket *get(utp_socket *sock) {
 		return static_cast<UTPSocket *>(utp_get_userdata(sock));
@@ -132,8 +413,18 @@ public:
 	static UTPSocket *get(v8::Local<v8::Object> obj) {
 		return ObjectWrap::Unwrap<UTPSocket>(obj);
 	}
-    UTPSocket(UTPContext *_utpctx, utp_socket *_sock);
+    static UTPSocket *create(UTPContext *utpctx, utp_socket *sock);
     ~UTPSocket();
+    size_t readBufferSize() const {
+        if (readIntoData) return readIntoFilled + readSpill.size() - readSpillOffset;
+        return readLen;
+    }
+    uint32_t getId() const { return id; }
+    bool isConnected() const { return connected; }
+    void readInto(const char *buf, size_t len);
+    void openRead(size_t len, size_t limit);
+    void sealRead();
+    void release();
 	void onRead(const void *buf, size_t len);
 	void onError(int errcode);
     void onConnect();
@@ -142,5 +433,6 @@ public:
     void onDestroy();
 
     static NAN_METHOD(CleanUp);
+    static NAN_METHOD(PoolStats);
 };
 }
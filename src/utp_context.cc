@@ -4,6 +4,7 @@ namespace nodeUTP {
 
 const char *UTPContext::statestr[] = {"STATE_INIT", "STATE_BOUND", "STATE_STOPPED"};
 Nan::Persistent<v8::Function> UTPContext::constructor;
+Nan::Persistent<v8::Function> UTPContext::eventHandler;
 
 UTPContext::UTPContext():
 ctx(utp_init(2), [] (utp_context *ctx) { if (ctx) utp_destroy(ctx); }),
@@ -13,19 +14,32 @@ backlog(0),
 connections(0),
 pendingConnections(0),
 refCount(0),
-refSelf(false)
+refSelf(false),
+readCoalesce(65536),
+readPool(true),
+readBlock(nullptr),
+flushing(false),
+closing(false),
+pendingCloses(0),
+rawMessages(false),
+telemetryRows(nullptr),
+profiling(false)
 {
+	memset(&transportStats, 0, sizeof(transportStats));
+	memset(stages, 0, sizeof(stages));
 	int assertionResult;
 	assertionResult = uv_udp_init(uv_default_loop(), &udpHandle);
 	assert(assertionResult >= 0);
-	assertionResult = uv_timer_init(uv_default_loop(), &timerHandle);
+	assertionResult = uv_check_init(uv_default_loop(), &checkHandle);
 	assert(assertionResult >= 0);
 
 	utp_context_set_userdata(ctx.get(), this);
+	// handshakes that do not complete in time are reported as ETIMEDOUT
+	utp_context_set_option(ctx.get(), UTP_CONNECT_TIMEOUT, CONNECT_TIMEOUT);
 	udpHandle.data = this;
-	timerHandle.data = this;
+	checkHandle.data = this;
 
-	for (int type: vector<int>({UTP_SENDTO, UTP_ON_ERROR, UTP_ON_STATE_CHANGE, UTP_ON_READ, UTP_ON_FIREWALL, UTP_ON_ACCEPT})) {
+	for (int type: vector<int>({UTP_SENDTO, UTP_ON_ERROR, UTP_ON_STATE_CHANGE, UTP_ON_READ, UTP_ON_FIREWALL, UTP_ON_ACCEPT, UTP_GET_READ_BUFFER_SIZE})) {
 		utp_set_callback(ctx.get(), type, [] (utp_callback_arguments *a) {
 			UTPContext *utpctx = static_cast<UTPContext *>(utp_context_get_userdata(a->context));
 			return utpctx->onCallback(a);
@@ -43,26 +57,30 @@ refSelf(false)
 }
 
 UTPContext::~UTPContext() {
+	for (auto &chunk: readChunks) {
+		if (chunk.slice) ReadPool::release(chunk.data);
+		else free(chunk.data);
+	}
+	if (readBlock) ReadPool::unref(readBlock);
+	telemetryBuffer.Reset();
+	traceBuffer.Reset();
 }
 
 void UTPContext::uvRef() {
 	refSelf = true;
 	uv_ref(reinterpret_cast<uv_handle_t *>(&udpHandle));
-	uv_ref(reinterpret_cast<uv_handle_t *>(&timerHandle));
 }
 
 void UTPContext::uvUnref() {
 	refSelf = false;
 	if (refCount == 0)	{
 		uv_unref(reinterpret_cast<uv_handle_t *>(&udpHandle));
-		uv_unref(reinterpret_cast<uv_handle_t *>(&timerHandle));
 	}
 }
 
 void UTPContext::sockRef() {
 	refCount++;
 	uv_ref(reinterpret_cast<uv_handle_t *>(&udpHandle));
-	uv_ref(reinterpret_cast<uv_handle_t *>(&timerHandle));
 }
 
 void UTPContext::sockUnref() {
@@ -70,7 +88,6 @@ void UTPContext::sockUnref() {
 	refCount--;
 	if (!refSelf)	{
 		uv_unref(reinterpret_cast<uv_handle_t *>(&udpHandle));
-		uv_unref(reinterpret_cast<uv_handle_t *>(&timerHandle));
 	}
 }
 
@@ -99,15 +116,17 @@ int UTPContext::bind(uint16_t port, string host) {
 		if (!utpctx->ctx.get()) return;
 		utpctx->uvRecv(nread, buf->base, addr, flags);
 		delete[] buf->base;
+		if (utpctx->closing) return;
 		utp_check_timeouts(utpctx->ctx.get());
 	});
 	assert(assertionResult >= 0);
-	assertionResult = uv_timer_start(&timerHandle, static_cast<void (*)(uv_timer_t *handle)> ([] (uv_timer_t *handle) -> void {
+	// deliver everything queued during this loop iteration in one go
+	assertionResult = uv_check_start(&checkHandle, static_cast<void (*)(uv_check_t *handle)> ([] (uv_check_t *handle) -> void {
 		UTPContext *utpctx = static_cast<UTPContext *>(handle->data);
-		if (!utpctx->ctx.get()) return;
-		utp_check_timeouts(utpctx->ctx.get());
-	}), 0, 500);
+		utpctx->flushEvents();
+	}));
 	assert(assertionResult >= 0);
+	uv_unref(reinterpret_cast<uv_handle_t *>(&checkHandle));
 	uvUnref();
 	Ref();
 	state = STATE_BOUND;
@@ -116,7 +135,6 @@ int UTPContext::bind(uint16_t port, string host) {
 
 int UTPContext::connect(uint16_t port, string host, UTPSocket **putpsock) {
 	assert(state == STATE_BOUND);
-	utp_socket *sock = nullptr;
 	union {
 		struct sockaddr saddr;
 		struct sockaddr_in sin;
@@ -124,18 +142,23 @@ int UTPContext::connect(uint16_t port, string host, UTPSocket **putpsock) {
 	} addr;
 	int errcode = 0;
 	if (uv_ip4_addr(host.c_str(), port, &addr.sin) >= 0) {
-		sock = utp_create_socket(ctx.get());
-		utp_connect(sock, &addr.saddr, sizeof(struct sockaddr_in));
+		connect(&addr.saddr, sizeof(struct sockaddr_in), putpsock);
 	} else if ((errcode = uv_ip6_addr(host.c_str(), port, &addr.sin6)) >= 0) {
-		sock = utp_create_socket(ctx.get());
-		utp_connect(sock, &addr.saddr, sizeof(struct sockaddr_in6));
+		connect(&addr.saddr, sizeof(struct sockaddr_in6), putpsock);
 	} else {
 		return errcode;
 	}
+	return 0;
+}
+
+void UTPContext::connect(const struct sockaddr *addr, socklen_t addrlen, UTPSocket **putpsock) {
+	assert(state == STATE_BOUND);
+	utp_socket *sock = utp_create_socket(ctx.get());
+	utp_connect(sock, addr, addrlen);
 	connections++;
 	pendingConnections++;
-	*putpsock = new UTPSocket(this, sock);
-	return 0;
+	TimerService::schedule(this, TIMEOUT_INTERVAL);
+	*putpsock = UTPSocket::create(this, sock);
 }
 
 void UTPContext::listen(int _backlog) {
@@ -152,23 +175,49 @@ void UTPContext::destroy() {
 	//std::cout << "try destroy" << std::endl;
 	uvUnref();
 	state = STATE_STOPPED;
-	if (connections == 0 && state == STATE_STOPPED) {
+	if (connections == 0 && state == STATE_STOPPED && !closing) {
 		//std::cout << "destroy" << std::endl;
+		closing = true;
+		flushEvents();
+		// the last chunks are sealed, the block lives on in js buffers only
+		if (readBlock) {
+			ReadPool::unref(readBlock);
+			readBlock = nullptr;
+		}
 		Nan::HandleScope scope;
 		v8::Local<v8::Function> onClose = Nan::Get(handle(), Nan::New("_onClose").ToLocalChecked()).ToLocalChecked().As<v8::Function>();
 		Nan::Callback(onClose).Call(0, 0);
 		uv_unref(reinterpret_cast<uv_handle_t *>(&udpHandle));
-		uv_unref(reinterpret_cast<uv_handle_t *>(&timerHandle));
-		Unref();
-		MakeWeak();
-		assert(uv_timer_stop(&timerHandle) >= 0);
+		TimerService::cancel(this);
+		assert(uv_check_stop(&checkHandle) >= 0);
 		assert(uv_udp_recv_stop(&udpHandle) >= 0);
-		uv_close(reinterpret_cast<uv_handle_t *>(&udpHandle), nullptr);
-		uv_close(reinterpret_cast<uv_handle_t *>(&timerHandle), nullptr);
-		//ctx.reset(nullptr); // bug: will check timeout after releasing the object (why?)
+		// we are usually called from inside libutp (a socket being destroyed
+		// while processing a packet or a timeout), so the context can only
+		// go away once the stack unwound and libuv let go of the handles
+		pendingCloses = 2;
+		uv_close(reinterpret_cast<uv_handle_t *>(&udpHandle), onHandleClosed);
+		uv_close(reinterpret_cast<uv_handle_t *>(&checkHandle), onHandleClosed);
 	}
 }
 
+bool UTPContext::checkTimeouts() {
+	if (closing) return false;
+	uint64_t start = stageStart();
+	utp_check_timeouts(ctx.get());
+	stageEnd(STAGE_TIMEOUTS, start);
+	// without connections libutp has nothing left to time out
+	return connections > 0 && !closing;
+}
+
+void UTPContext::onHandleClosed(uv_handle_t *handle) {
+	UTPContext *utpctx = static_cast<UTPContext *>(handle->data);
+	if (--utpctx->pendingCloses > 0) return;
+	Nan::HandleScope scope;
+	utpctx->ctx.reset(nullptr);
+	utpctx->Unref();
+	utpctx->MakeWeak();
+}
+
 uint64 UTPContext::onCallback(utp_callback_arguments *a) {
 	UTPSocket *utpsock;
 	switch (a->callback_type) {
@@ -179,6 +228,7 @@ uint64 UTPContext::onCallback(utp_callback_arguments *a) {
 	case UTP_ON_ACCEPT:
 		connections++;
 		pendingConnections++;
+		TimerService::schedule(this, TIMEOUT_INTERVAL);
 		onAccept(a->socket);
 		return 0;
 
@@ -186,6 +236,11 @@ uint64 UTPContext::onCallback(utp_callback_arguments *a) {
 		utpsock = UTPSocket::get(a->socket);
 		UTPSocket::get(a->socket)->onRead(a->buf, a->len);
 		return 0;
+	case UTP_GET_READ_BUFFER_SIZE:
+		// queried before the wrapper exists (syn-ack, outgoing syn)
+		utpsock = UTPSocket::get(a->socket);
+		if (!utpsock) return 0;
+		return utpsock->readBufferSize();
 	case UTP_ON_STATE_CHANGE:
 		utpsock = UTPSocket::get(a->socket);
 		switch (a->state) {
@@ -200,6 +255,8 @@ uint64 UTPContext::onCallback(utp_callback_arguments *a) {
 			utpsock->onEnd();
 			return 0;
 		case UTP_STATE_DESTROYING:
+			// a handshake that timed out or was refused never reached CONNECT
+			if (!utpsock->isConnected()) pendingConnections--;
 			utpsock->onDestroy();
 			connections--;
 			if (state == STATE_STOPPED) destroy();
@@ -216,59 +273,139 @@ uint64 UTPContext::onCallback(utp_callback_arguments *a) {
 
 void UTPContext::uvRecv(ssize_t len, const void *buf, const struct sockaddr *addr, unsigned flags) {
 	assert(len >= 0);
+	uint64_t start = stageStart();
 	if (!len && !addr) {
 		// no more data
 		utp_issue_deferred_acks(ctx.get());
 	} else {
 		size_t addrlen = addr->sa_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
-		if (!utp_process_udp(ctx.get(), static_cast<const byte *>(buf), len, addr, addrlen)) {
-			Nan::HandleScope scope;
-			// printf("UDP packet not handled by UTP.  Ignoring.\n");
-			v8::Local<v8::Function> onConn = Nan::Get(handle(), Nan::New("_onUnrecognizedMessage").ToLocalChecked()).ToLocalChecked().As<v8::Function>();
-
-			int assertionResult;
-			char address[50];
-			v8::Local<v8::Object> rinfo = Nan::New<v8::Object>();
-			assert(addr->sa_family == AF_INET || addr->sa_family == AF_INET6);
-			if (addr->sa_family == AF_INET) {
-				// ipv4
-				assertionResult = uv_ip4_name(reinterpret_cast<const sockaddr_in *>(addr), address, 50);
-				assert(assertionResult >= 0);
-				rinfo->Set(Nan::New("address").ToLocalChecked(), Nan::New(address).ToLocalChecked());
-				rinfo->Set(Nan::New("family").ToLocalChecked(), Nan::New("IPv4").ToLocalChecked());
-				rinfo->Set(Nan::New("port").ToLocalChecked(), Nan::New<v8::Uint32>(ntohs(reinterpret_cast<const sockaddr_in *>(addr)->sin_port)));
-			} else {
-				// ipv6
-				assertionResult = uv_ip6_name(reinterpret_cast<const sockaddr_in6 *>(addr), address, 50);
-				assert(assertionResult >= 0);
-				rinfo->Set(Nan::New("address").ToLocalChecked(), Nan::New(address).ToLocalChecked());
-				rinfo->Set(Nan::New("family").ToLocalChecked(), Nan::New("IPv6").ToLocalChecked());
-				rinfo->Set(Nan::New("port").ToLocalChecked(), Nan::New<v8::Uint32>(ntohs(reinterpret_cast<const sockaddr_in6 *>(addr)->sin6_port)));
+		const unsigned char *data = static_cast<const unsigned char *>(buf);
+		if (isUTPHeader(data, len)) {
+			uint64_t processStart = stageStart();
+			int processed = utp_process_udp(ctx.get(), data, len, addr, addrlen);
+			stageEnd(STAGE_PROCESS, processStart);
+			if (processed) {
+				transportStats.utpReceived++;
+				transportStats.utpReceivedBytes += len;
+				stageEnd(STAGE_RECV, start);
+				return;
 			}
-
-			v8::Local<v8::Value> argv[2] = { Nan::CopyBuffer(static_cast<const char *>(buf), len).ToLocalChecked(), rinfo };
-			Nan::Callback(onConn).Call(1, argv);
 		}
+		transportStats.rawReceived++;
+		transportStats.rawReceivedBytes += len;
+		// anything else sharing the port (dht, ...) goes to js in one batch
+		if (rawMessages) queueRaw(data, len, addr);
+	}
+	stageEnd(STAGE_RECV, start);
+}
+
+/*
+ * uTP v1 packets start with type (ST_DATA..ST_SYN) in the high nibble and
+ * version 1 in the low one, which rules out bencoded messages ('d' = 0x64)
+ * without handing them to libutp first.
+ */
+bool UTPContext::isUTPHeader(const unsigned char *data, size_t len) {
+	return len >= 20 && (data[0] & 0x0f) == 1 && (data[0] >> 4) <= 4;
+}
+
+void UTPContext::queueRaw(const unsigned char *data, size_t len, const struct sockaddr *addr) {
+	RawMessage msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.offset = rawPayload.size();
+	msg.length = len;
+	assert(addr->sa_family == AF_INET || addr->sa_family == AF_INET6);
+	if (addr->sa_family == AF_INET) {
+		const sockaddr_in *sin = reinterpret_cast<const sockaddr_in *>(addr);
+		msg.family = 4;
+		msg.port = ntohs(sin->sin_port);
+		memcpy(msg.address, &sin->sin_addr, 4);
+	} else {
+		const sockaddr_in6 *sin6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+		msg.family = 6;
+		msg.port = ntohs(sin6->sin6_port);
+		memcpy(msg.address, &sin6->sin6_addr, 16);
 	}
+	rawPayload.insert(rawPayload.end(), data, data + len);
+	rawRecords.push_back(msg);
 }
 
 uint64 UTPContext::sendTo(const void *buf, size_t len, const struct sockaddr *addr, socklen_t addrlen) {
-	unique_ptr<char[]> tmpbuf(new char[len]);
-	memcpy(tmpbuf.get(), buf, len);
-	uv_buf_t uvbuf;
-	uvbuf.base = tmpbuf.get();
-	uvbuf.len = len;
-
-	// workaround but uv_udp_send is very very very slow but I don't know why
-	static uv_udp_send_t req;
-	if (uv_udp_try_send(&udpHandle, &uvbuf, 1, addr) < 0) {
-		int assertionResult;
-		assertionResult = uv_udp_send(&req, &udpHandle, &uvbuf, 1, addr, [] (uv_udp_send_t *req, int status) {});
-		assert(assertionResult >= 0);
+	uint64_t start = stageStart();
+	sendDatagram(static_cast<const char *>(buf), len, addr, false);
+	stageEnd(STAGE_SEND, start);
+	return 0;
+}
+
+/*
+ * Sends right away when the socket can take it. Otherwise the datagram is
+ * copied into its own request and queued in libuv, and later datagrams line
+ * up behind it so nothing is reordered.
+ */
+int UTPContext::sendDatagram(const char *data, size_t len, const struct sockaddr *addr, bool raw) {
+	uv_buf_t uvbuf = uv_buf_init(const_cast<char *>(data), len);
+	int result = UV_EAGAIN;
+	if (udpHandle.send_queue_count == 0) result = uv_udp_try_send(&udpHandle, &uvbuf, 1, addr);
+	if (result == UV_EAGAIN || result == UV_ENOSYS) {
+		SendRequest *sendReq = new SendRequest;
+		sendReq->req.data = sendReq;
+		sendReq->data.reset(new char[len]);
+		memcpy(sendReq->data.get(), data, len);
+		uvbuf.base = sendReq->data.get();
+		result = uv_udp_send(&sendReq->req, &udpHandle, &uvbuf, 1, addr, [] (uv_udp_send_t *req, int status) {
+			UTPContext *utpctx = static_cast<UTPContext *>(req->handle->data);
+			if (status < 0 && status != UV_ECANCELED) utpctx->transportStats.sendErrors++;
+			delete static_cast<SendRequest *>(req->data);
+		});
+		if (result < 0) delete sendReq;
+		else transportStats.queuedSends++;
+	}
+	if (result < 0) {
+		transportStats.sendErrors++;
+		return result;
+	}
+	if (raw) {
+		transportStats.rawSent++;
+		transportStats.rawSentBytes += len;
+	} else {
+		transportStats.utpSent++;
+		transportStats.utpSentBytes += len;
 	}
 	return 0;
 }
 
+/* a compact peer buffer (ip + port, 6 or 18 bytes) or { address, port } */
+int UTPContext::parseAddress(v8::Local<v8::Value> value, struct sockaddr_storage *addr) {
+	memset(addr, 0, sizeof(*addr));
+	if (node::Buffer::HasInstance(value)) {
+		const unsigned char *data = reinterpret_cast<const unsigned char *>(node::Buffer::Data(value));
+		size_t len = node::Buffer::Length(value);
+		if (len == 6) {
+			struct sockaddr_in *sin = reinterpret_cast<struct sockaddr_in *>(addr);
+			sin->sin_family = AF_INET;
+			memcpy(&sin->sin_addr, data, 4);
+			memcpy(&sin->sin_port, data + 4, 2);
+			return 0;
+		} else if (len == 18) {
+			struct sockaddr_in6 *sin6 = reinterpret_cast<struct sockaddr_in6 *>(addr);
+			sin6->sin6_family = AF_INET6;
+			memcpy(&sin6->sin6_addr, data, 16);
+			memcpy(&sin6->sin6_port, data + 16, 2);
+			return 0;
+		}
+		return UV_EINVAL;
+	}
+	if (!value->IsObject()) return UV_EINVAL;
+	v8::Local<v8::Object> obj = value.As<v8::Object>();
+	v8::Local<v8::Value> address = Nan::Get(obj, Nan::New("address").ToLocalChecked()).ToLocalChecked();
+	v8::Local<v8::Value> port = Nan::Get(obj, Nan::New("port").ToLocalChecked()).ToLocalChecked();
+	if (!address->IsString() || !port->IsNumber()) return UV_EINVAL;
+	Nan::Utf8String host(address);
+	int portnum = Nan::To<int32_t>(port).FromJust();
+	if (portnum <= 0 || portnum > 65535) return UV_EINVAL;
+	if (uv_ip4_addr(*host, portnum, reinterpret_cast<struct sockaddr_in *>(addr)) >= 0) return 0;
+	return uv_ip6_addr(*host, portnum, reinterpret_cast<struct sockaddr_in6 *>(addr));
+}
+
 bool UTPContext::onFirewall() {
 	if (state != STATE_BOUND || !listening) return true; // not a listen socket
 	if (backlog > 0 && pendingConnections >= backlog) return true; // pending connections reach limit
@@ -277,12 +414,124 @@ bool UTPContext::onFirewall() {
 
 void UTPContext::onAccept(utp_socket *sock) {
 	assert(state == STATE_BOUND && listening);
-	Nan::HandleScope scope;
-	UTPSocket *utpsock = new UTPSocket(this, sock);
-	v8::Local<v8::Object> connObj = utpsock->handle();
-	v8::Local<v8::Function> onConn = Nan::Get(handle(), Nan::New("_onConnection").ToLocalChecked()).ToLocalChecked().As<v8::Function>();
-	v8::Local<v8::Value> argv[1] = {connObj};
-	Nan::Callback(onConn).Call(1, argv);
+	UTPSocket *utpsock = UTPSocket::create(this, sock);
+	accepted.push_back(utpsock);
+	queueEvent(utpsock, EVENT_ACCEPT, accepted.size() - 1);
+}
+
+void UTPContext::queueEvent(UTPSocket *utpsock, uint32_t type, uint32_t arg) {
+	Event event = { utpsock->getId(), type, arg };
+	events.push_back(event);
+}
+
+uint32_t UTPContext::queueRead(UTPSocket *utpsock) {
+	uint32_t index = readChunks.size();
+	readChunks.push_back({nullptr, 0, nullptr});
+	reading.push_back(utpsock);
+	queueEvent(utpsock, EVENT_READ, index);
+	return index;
+}
+
+/*
+ * The block pooled chunks are cut from, shared by all sockets of the
+ * context and replaced once full.
+ */
+ReadPool::Block *UTPContext::fillBlock() {
+	if (!readBlock || readBlock->used == ReadPool::BLOCK_SIZE) {
+		if (readBlock) ReadPool::unref(readBlock);
+		readBlock = ReadPool::acquire();
+	}
+	return readBlock;
+}
+
+uint32_t UTPContext::queueReadInto(UTPSocket *utpsock) {
+	uint32_t index = events.size();
+	reading.push_back(utpsock);
+	// the byte count is filled in when the socket is sealed
+	queueEvent(utpsock, EVENT_READ_INTO);
+	return index;
+}
+
+void UTPContext::releaseSocket(UTPSocket *utpsock) {
+	released.push_back(utpsock);
+}
+
+utp_socket_telemetry *UTPContext::acquireTelemetryRow(int32_t *index) {
+	// no table, or more sockets than rows
+	if (telemetryFree.empty()) return nullptr;
+	*index = telemetryFree.back();
+	telemetryFree.pop_back();
+	return &telemetryRows[*index];
+}
+
+void UTPContext::releaseTelemetryRow(int32_t index) {
+	utp_socket_telemetry *row = &telemetryRows[index];
+	// a reader comparing seq before and after sees the row change
+	double seq = row->seq + 2;
+	memset(row, 0, sizeof(*row));
+	row->seq = seq;
+	telemetryFree.push_back(index);
+}
+
+/*
+ * Hands every queued event to js in a single call:
+ *   handler.call(context, records, chunks, accepted, raw, rawData)
+ * records packs one Event (3 x uint32) per entry, chunks holds one buffer
+ * per EVENT_READ with all bytes a socket received in this pass (up to
+ * readCoalesce) and accepted holds the handles of newly accepted sockets.
+ * raw packs one RawMessage per non-utp datagram with all their payloads
+ * in rawData, both are undefined if there were none.
+ */
+void UTPContext::flushEvents() {
+	// events queued by js while we are dispatching go out in the next round
+	if (flushing) return;
+	flushing = true;
+	while (!events.empty() || !rawRecords.empty()) {
+		Nan::HandleScope scope;
+		vector<Event> batch;
+		vector<ReadChunk> reads;
+		vector<UTPSocket *> accepts, releases;
+		for (UTPSocket *utpsock: reading) {
+			utpsock->sealRead();
+		}
+		reading.clear();
+		batch.swap(events);
+		reads.swap(readChunks);
+		accepts.swap(accepted);
+		releases.swap(released);
+
+		v8::Local<v8::Value> records = Nan::CopyBuffer(reinterpret_cast<const char *>(batch.data()), batch.size() * sizeof(Event)).ToLocalChecked();
+		v8::Local<v8::Array> chunks = Nan::New<v8::Array>(reads.size());
+		for (size_t i = 0; i < reads.size(); i++) {
+			ReadChunk &chunk = reads[i];
+			if (chunk.slice) {
+				Nan::Set(chunks, i, ReadPool::wrap(chunk.data, chunk.len, chunk.slice));
+			} else {
+				// the buffer takes ownership of the chunk memory
+				Nan::Set(chunks, i, Nan::NewBuffer(chunk.data, chunk.len).ToLocalChecked());
+			}
+		}
+		v8::Local<v8::Array> handles = Nan::New<v8::Array>(accepts.size());
+		for (size_t i = 0; i < accepts.size(); i++) {
+			Nan::Set(handles, i, accepts[i]->handle());
+		}
+		v8::Local<v8::Value> raw = Nan::Undefined(), rawData = Nan::Undefined();
+		if (!rawRecords.empty()) {
+			raw = Nan::CopyBuffer(reinterpret_cast<const char *>(rawRecords.data()), rawRecords.size() * sizeof(RawMessage)).ToLocalChecked();
+			rawData = Nan::CopyBuffer(rawPayload.data(), rawPayload.size()).ToLocalChecked();
+			rawRecords.clear();
+			rawPayload.clear();
+		}
+		v8::Local<v8::Value> argv[] = {records, chunks, handles, raw, rawData};
+		uint64_t start = stageStart();
+		Nan::MakeCallback(handle(), Nan::New(eventHandler), 5, argv);
+		stageEnd(STAGE_DISPATCH, start);
+
+		for (UTPSocket *utpsock: releases) {
+			utpsock->release();
+		}
+	}
+	flushing = false;
 }
 
 void UTPContext::Init(v8::Local<v8::Object> exports, v8::Local<v8::Object> module) {
@@ -295,16 +544,36 @@ void UTPContext::Init(v8::Local<v8::Object> exports, v8::Local<v8::Object> modul
 	Nan::SetPrototypeMethod(tpl, "bind", Bind);
 	Nan::SetPrototypeMethod(tpl, "listen", Listen);
 	Nan::SetPrototypeMethod(tpl, "connect", Connect);
+	Nan::SetPrototypeMethod(tpl, "connectPacked", ConnectPacked);
 	Nan::SetPrototypeMethod(tpl, "close", Close);
 	Nan::SetPrototypeMethod(tpl, "state", State);
 	Nan::SetPrototypeMethod(tpl, "address", Address);
 	Nan::SetPrototypeMethod(tpl, "ref", jsRef);
 	Nan::SetPrototypeMethod(tpl, "unref", jsUnref);
+	Nan::SetPrototypeMethod(tpl, "setReadCoalesce", SetReadCoalesce);
+	Nan::SetPrototypeMethod(tpl, "setReadPool", SetReadPool);
+	Nan::SetPrototypeMethod(tpl, "setConnectTimeout", SetConnectTimeout);
+	Nan::SetPrototypeMethod(tpl, "setMaxConnections", SetMaxConnections);
+	Nan::SetPrototypeMethod(tpl, "setSocketLatency", SetSocketLatency);
+	Nan::SetPrototypeMethod(tpl, "setRawMessages", SetRawMessages);
+	Nan::SetPrototypeMethod(tpl, "sendRaw", SendRaw);
+	Nan::SetPrototypeMethod(tpl, "getStats", GetStats);
+	Nan::SetPrototypeMethod(tpl, "setTelemetry", SetTelemetry);
+	Nan::SetPrototypeMethod(tpl, "getLatency", GetLatency);
+	Nan::SetPrototypeMethod(tpl, "setTrace", SetTrace);
+	Nan::SetPrototypeMethod(tpl, "setProfile", SetProfile);
+	Nan::SetPrototypeMethod(tpl, "getProfile", GetProfile);
 
 	exports->Set(Nan::New("UTPContext").ToLocalChecked(), tpl->GetFunction());
+	exports->Set(Nan::New("setEventHandler").ToLocalChecked(), Nan::New<v8::FunctionTemplate>(SetEventHandler)->GetFunction());
 	constructor.Reset(tpl->GetFunction());
 }
 
+NAN_METHOD(UTPContext::SetEventHandler) {
+	Nan::HandleScope scope;
+	eventHandler.Reset(info[0].As<v8::Function>());
+}
+
 NAN_METHOD(UTPContext::New) {
 	Nan::HandleScope scope;
 	UTPContext *utpctx = new UTPContext();
@@ -397,6 +666,43 @@ NAN_METHOD(UTPContext::Connect) {
 	}
 }
 
+// connect(port, addr) with addr the 4 or 16 raw bytes of an ip address
+NAN_METHOD(UTPContext::ConnectPacked) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	unsigned int port = Nan::To<v8::Uint32>(info[0]).ToLocalChecked()->Value();
+	v8::Local<v8::Object> buf = info[1].As<v8::Object>();
+	const char *data = node::Buffer::Data(buf);
+	size_t len = node::Buffer::Length(buf);
+	assert(utpctx->state == STATE_BOUND);
+	union {
+		struct sockaddr saddr;
+		struct sockaddr_in sin;
+		struct sockaddr_in6 sin6;
+	} addr;
+	memset(&addr, 0, sizeof(addr));
+	socklen_t addrlen;
+	if (len == 4) {
+		addr.sin.sin_family = AF_INET;
+		addr.sin.sin_port = htons(static_cast<uint16_t>(port));
+		memcpy(&addr.sin.sin_addr, data, 4);
+		addrlen = sizeof(struct sockaddr_in);
+	} else if (len == 16) {
+		addr.sin6.sin6_family = AF_INET6;
+		addr.sin6.sin6_port = htons(static_cast<uint16_t>(port));
+		memcpy(&addr.sin6.sin6_addr, data, 16);
+		addrlen = sizeof(struct sockaddr_in6);
+	} else {
+		v8::Local<v8::Value> err = Nan::Error(uv_strerror(UV_EINVAL));
+		Nan::To<v8::Object>(err).ToLocalChecked()->Set(Nan::New("code").ToLocalChecked(), Nan::New(uv_err_name(UV_EINVAL)).ToLocalChecked());
+		Nan::ThrowError(err);
+		return;
+	}
+	UTPSocket *utpsock;
+	utpctx->connect(&addr.saddr, addrlen, &utpsock);
+	info.GetReturnValue().Set(utpsock->handle());
+}
+
 NAN_METHOD(UTPContext::Close) {
 	Nan::HandleScope scope;
 	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
@@ -409,6 +715,270 @@ NAN_METHOD(UTPContext::jsRef) {
 	utpctx->uvRef();
 }
 
+NAN_METHOD(UTPContext::SetReadCoalesce) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	unsigned int size = Nan::To<v8::Uint32>(info[0]).ToLocalChecked()->Value();
+	utpctx->readCoalesce = std::max<size_t>(size, 1);
+}
+
+// sendRaw(bufs, addrs): one address per buffer, or a single one for all
+NAN_METHOD(UTPContext::SendRaw) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	assert(utpctx->state == STATE_BOUND);
+	v8::Local<v8::Array> bufs = info[0].As<v8::Array>();
+	v8::Local<v8::Array> addrs = info[1].As<v8::Array>();
+	uint32_t count = bufs->Length();
+	// check everything first so a bad address does not leave half a batch sent
+	vector<struct sockaddr_storage> sockaddrs(addrs->Length());
+	int result = addrs->Length() == count || addrs->Length() == 1 ? 0 : UV_EINVAL;
+	for (uint32_t i = 0; i < sockaddrs.size() && result == 0; i++) {
+		result = parseAddress(Nan::Get(addrs, i).ToLocalChecked(), &sockaddrs[i]);
+	}
+	for (uint32_t i = 0; i < count && result == 0; i++) {
+		if (!node::Buffer::HasInstance(Nan::Get(bufs, i).ToLocalChecked())) result = UV_EINVAL;
+	}
+	if (result < 0) {
+		v8::Local<v8::Value> err = Nan::Error(uv_strerror(result));
+		Nan::To<v8::Object>(err).ToLocalChecked()->Set(Nan::New("code").ToLocalChecked(), Nan::New(uv_err_name(result)).ToLocalChecked());
+		Nan::ThrowError(err);
+		return;
+	}
+	uint32_t sent = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		v8::Local<v8::Value> buf = Nan::Get(bufs, i).ToLocalChecked();
+		const struct sockaddr *addr = reinterpret_cast<const struct sockaddr *>(&sockaddrs[sockaddrs.size() == 1 ? 0 : i]);
+		if (utpctx->sendDatagram(node::Buffer::Data(buf), node::Buffer::Length(buf), addr, true) == 0) sent++;
+	}
+	info.GetReturnValue().Set(Nan::New<v8::Uint32>(sent));
+}
+
+NAN_METHOD(UTPContext::GetStats) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	const TransportStats &stats = utpctx->transportStats;
+	v8::Local<v8::Object> res = Nan::New<v8::Object>();
+	Nan::Set(res, Nan::New("utpSent").ToLocalChecked(), Nan::New<v8::Number>(stats.utpSent));
+	Nan::Set(res, Nan::New("utpSentBytes").ToLocalChecked(), Nan::New<v8::Number>(stats.utpSentBytes));
+	Nan::Set(res, Nan::New("utpReceived").ToLocalChecked(), Nan::New<v8::Number>(stats.utpReceived));
+	Nan::Set(res, Nan::New("utpReceivedBytes").ToLocalChecked(), Nan::New<v8::Number>(stats.utpReceivedBytes));
+	Nan::Set(res, Nan::New("rawSent").ToLocalChecked(), Nan::New<v8::Number>(stats.rawSent));
+	Nan::Set(res, Nan::New("rawSentBytes").ToLocalChecked(), Nan::New<v8::Number>(stats.rawSentBytes));
+	Nan::Set(res, Nan::New("rawReceived").ToLocalChecked(), Nan::New<v8::Number>(stats.rawReceived));
+	Nan::Set(res, Nan::New("rawReceivedBytes").ToLocalChecked(), Nan::New<v8::Number>(stats.rawReceivedBytes));
+	Nan::Set(res, Nan::New("queuedSends").ToLocalChecked(), Nan::New<v8::Number>(stats.queuedSends));
+	Nan::Set(res, Nan::New("sendErrors").ToLocalChecked(), Nan::New<v8::Number>(stats.sendErrors));
+	if (!utpctx->ctx) {
+		// closed, libutp's counters went with it
+		info.GetReturnValue().Set(res);
+		return;
+	}
+	// what libutp did with the utp datagrams, drops by reason; datagrams too
+	// short or of another version never reach it, they count as raw
+	const utp_context_stats *ustats = utp_get_context_stats(utpctx->ctx.get());
+	Nan::Set(res, Nan::New("synAccepted").ToLocalChecked(), Nan::New<v8::Number>(ustats->syn_accepted));
+	Nan::Set(res, Nan::New("synRejected").ToLocalChecked(), Nan::New<v8::Number>(ustats->syn_rejected));
+	Nan::Set(res, Nan::New("dropFirewall").ToLocalChecked(), Nan::New<v8::Number>(ustats->drop_firewall));
+	Nan::Set(res, Nan::New("dropConnectionLimit").ToLocalChecked(), Nan::New<v8::Number>(ustats->drop_conn_limit));
+	Nan::Set(res, Nan::New("dropInvalidAck").ToLocalChecked(), Nan::New<v8::Number>(ustats->drop_invalid_ack));
+	Nan::Set(res, Nan::New("rstSent").ToLocalChecked(), Nan::New<v8::Number>(ustats->rst_sent));
+	Nan::Set(res, Nan::New("rstSuppressed").ToLocalChecked(), Nan::New<v8::Number>(ustats->rst_suppressed));
+	Nan::Set(res, Nan::New("sockets").ToLocalChecked(), Nan::New<v8::Number>(ustats->nsockets));
+	Nan::Set(res, Nan::New("deferredAcks").ToLocalChecked(), Nan::New<v8::Number>(ustats->nack_sockets));
+	Nan::Set(res, Nan::New("rstInfo").ToLocalChecked(), Nan::New<v8::Number>(ustats->nrst_info));
+	Nan::Set(res, Nan::New("sweeps").ToLocalChecked(), Nan::New<v8::Number>(ustats->sweeps));
+	Nan::Set(res, Nan::New("sweepMicros").ToLocalChecked(), Nan::New<v8::Number>(ustats->sweep_us));
+	Nan::Set(res, Nan::New("sweepMaxMicros").ToLocalChecked(), Nan::New<v8::Number>(ustats->sweep_max_us));
+	// packets by size: header only, up to 373, 723, 1400 bytes, larger
+	v8::Local<v8::Array> recvSizes = Nan::New<v8::Array>(5);
+	v8::Local<v8::Array> sendSizes = Nan::New<v8::Array>(5);
+	for (uint32_t i = 0; i < 5; i++) {
+		Nan::Set(recvSizes, i, Nan::New<v8::Number>(ustats->_nraw_recv[i]));
+		Nan::Set(sendSizes, i, Nan::New<v8::Number>(ustats->_nraw_send[i]));
+	}
+	Nan::Set(res, Nan::New("recvSizes").ToLocalChecked(), recvSizes);
+	Nan::Set(res, Nan::New("sendSizes").ToLocalChecked(), sendSizes);
+	info.GetReturnValue().Set(res);
+}
+
+/*
+ * Allocates a table of utp_socket_telemetry rows and returns the buffer
+ * behind it. Sockets take a free row when they attach and libutp updates it
+ * in place as packets come in and on every timeout sweep, so js (or a worker
+ * the buffer was posted to) reads all connections without calling in here.
+ */
+NAN_METHOD(UTPContext::SetTelemetry) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	assert(!utpctx->telemetryRows);
+	uint32_t rows = Nan::To<v8::Uint32>(info[0]).ToLocalChecked()->Value();
+	assert(rows > 0);
+	size_t len = rows * sizeof(utp_socket_telemetry);
+	// zero filled, so unused rows read as state 0
+#if NODE_MODULE_VERSION >= 57
+	// node 8+, a worker can share it
+	v8::Local<v8::SharedArrayBuffer> buf = v8::SharedArrayBuffer::New(v8::Isolate::GetCurrent(), len);
+#else
+	v8::Local<v8::ArrayBuffer> buf = v8::ArrayBuffer::New(v8::Isolate::GetCurrent(), len);
+#endif
+	utpctx->telemetryRows = static_cast<utp_socket_telemetry *>(buf->GetContents().Data());
+	utpctx->telemetryBuffer.Reset(buf);
+	// hand out low rows first
+	for (uint32_t i = rows; i > 0; i--) utpctx->telemetryFree.push_back(i - 1);
+	info.GetReturnValue().Set(buf);
+}
+
+/*
+ * Starts tracing into a new ring of the given number of utp_trace_record
+ * and returns the buffer behind it (utp_trace_ring layout), or stops
+ * tracing if the number is 0. libutp only checks a pointer while it is off.
+ */
+NAN_METHOD(UTPContext::SetTrace) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	assert(utpctx->ctx);
+	uint32_t records = Nan::To<v8::Uint32>(info[0]).ToLocalChecked()->Value();
+	utp_context_set_trace(utpctx->ctx.get(), nullptr);
+	utpctx->traceBuffer.Reset();
+	if (records == 0) return;
+	size_t len = UTP_TRACE_RING_SIZE(records);
+#if NODE_MODULE_VERSION >= 57
+	v8::Local<v8::SharedArrayBuffer> buf = v8::SharedArrayBuffer::New(v8::Isolate::GetCurrent(), len);
+#else
+	v8::Local<v8::ArrayBuffer> buf = v8::ArrayBuffer::New(v8::Isolate::GetCurrent(), len);
+#endif
+	utp_trace_ring *ring = static_cast<utp_trace_ring *>(buf->GetContents().Data());
+	ring->capacity = records;
+	utp_context_set_trace(utpctx->ctx.get(), ring);
+	utpctx->traceBuffer.Reset(buf);
+	info.GetReturnValue().Set(buf);
+}
+
+/*
+ * Turns timing of the pipeline stages on or off. Turning it on starts the
+ * counts over; libutp then also times its congestion control.
+ */
+NAN_METHOD(UTPContext::SetProfile) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	assert(utpctx->ctx);
+	bool enable = Nan::To<bool>(info[0]).FromJust();
+	if (enable && !utpctx->profiling) {
+		memset(utpctx->stages, 0, sizeof(utpctx->stages));
+		utp_context_stats *ustats = utp_get_context_stats(utpctx->ctx.get());
+		ustats->ccontrol_calls = ustats->ccontrol_ns = 0;
+	}
+	utpctx->profiling = enable;
+	utp_context_set_profile_clock(utpctx->ctx.get(), enable ? profileClock : nullptr);
+}
+
+/*
+ * { stage: { calls, ns } } for recv, process, ccontrol, dispatch, timeouts
+ * and send, counted while profiling was on.
+ */
+NAN_METHOD(UTPContext::GetProfile) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	static const char *names[STAGE_COUNT] = {"recv", "process", "dispatch", "timeouts", "send"};
+	v8::Local<v8::Object> res = Nan::New<v8::Object>();
+	auto set = [&res] (const char *name, uint64_t calls, uint64_t ns) {
+		v8::Local<v8::Object> stage = Nan::New<v8::Object>();
+		Nan::Set(stage, Nan::New("calls").ToLocalChecked(), Nan::New<v8::Number>(calls));
+		Nan::Set(stage, Nan::New("ns").ToLocalChecked(), Nan::New<v8::Number>(ns));
+		Nan::Set(res, Nan::New(name).ToLocalChecked(), stage);
+	};
+	for (int i = 0; i < STAGE_COUNT; i++) {
+		set(names[i], utpctx->stages[i].calls, utpctx->stages[i].ns);
+	}
+	if (utpctx->ctx) {
+		utp_context_stats *ustats = utp_get_context_stats(utpctx->ctx.get());
+		set("ccontrol", ustats->ccontrol_calls, ustats->ccontrol_ns);
+	}
+	info.GetReturnValue().Set(res);
+}
+
+static v8::Local<v8::Object> histogramObject(const utp_histogram *h, v8::Local<v8::Array> percentiles) {
+	v8::Local<v8::Object> res = Nan::New<v8::Object>();
+	Nan::Set(res, Nan::New("count").ToLocalChecked(), Nan::New<v8::Number>(h->count));
+	Nan::Set(res, Nan::New("min").ToLocalChecked(), Nan::New<v8::Number>(h->min));
+	Nan::Set(res, Nan::New("max").ToLocalChecked(), Nan::New<v8::Number>(h->max));
+	Nan::Set(res, Nan::New("mean").ToLocalChecked(), Nan::New<v8::Number>(h->count ? double(h->sum) / h->count : 0));
+	v8::Local<v8::Object> values = Nan::New<v8::Object>();
+	for (uint32_t i = 0; i < percentiles->Length(); i++) {
+		v8::Local<v8::Value> p = Nan::Get(percentiles, i).ToLocalChecked();
+		Nan::Set(values, p, Nan::New<v8::Number>(utp_histogram_percentile(h, Nan::To<double>(p).FromJust())));
+	}
+	Nan::Set(res, Nan::New("percentiles").ToLocalChecked(), values);
+	return res;
+}
+
+v8::Local<v8::Object> UTPContext::latencyObject(utp_histogram *rtt, utp_histogram *delay, v8::Local<v8::Value> percentiles) {
+	v8::Local<v8::Array> list = percentiles->IsArray() ? percentiles.As<v8::Array>() : Nan::New<v8::Array>();
+	v8::Local<v8::Object> res = Nan::New<v8::Object>();
+	Nan::Set(res, Nan::New("rtt").ToLocalChecked(), histogramObject(rtt, list));
+	Nan::Set(res, Nan::New("delay").ToLocalChecked(), histogramObject(delay, list));
+	return res;
+}
+
+/*
+ * Rtt and queuing delay (microseconds) of every connection the context had,
+ * as count, min, max, mean and the requested percentiles. Starts over if
+ * the second argument is true.
+ */
+NAN_METHOD(UTPContext::GetLatency) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	if (!utpctx->ctx) {
+		info.GetReturnValue().Set(Nan::Null());
+		return;
+	}
+	utp_histogram *rtt = utp_context_get_histogram(utpctx->ctx.get(), UTP_HISTOGRAM_RTT);
+	utp_histogram *delay = utp_context_get_histogram(utpctx->ctx.get(), UTP_HISTOGRAM_DELAY);
+	info.GetReturnValue().Set(latencyObject(rtt, delay, info[0]));
+	if (Nan::To<bool>(info[1]).FromJust()) {
+		memset(rtt, 0, sizeof(*rtt));
+		memset(delay, 0, sizeof(*delay));
+	}
+}
+
+NAN_METHOD(UTPContext::SetRawMessages) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	// without anyone listening non-utp datagrams are dropped right away
+	utpctx->rawMessages = Nan::To<bool>(info[0]).FromJust();
+}
+
+NAN_METHOD(UTPContext::SetConnectTimeout) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	// 0 disables the limit, affects connections started from now on
+	int timeout = Nan::To<v8::Uint32>(info[0]).ToLocalChecked()->Value();
+	utp_context_set_option(utpctx->ctx.get(), UTP_CONNECT_TIMEOUT, timeout);
+}
+
+NAN_METHOD(UTPContext::SetMaxConnections) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	// 0 lifts libutp's cap of 3000; connections already open are kept
+	int limit = Nan::To<v8::Uint32>(info[0]).ToLocalChecked()->Value();
+	utp_context_set_option(utpctx->ctx.get(), UTP_MAX_SOCKETS, limit);
+}
+
+NAN_METHOD(UTPContext::SetSocketLatency) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	// off, sockets only feed the context's histograms and save ~2 KB each
+	utp_context_set_option(utpctx->ctx.get(), UTP_SOCKET_HISTOGRAMS, Nan::To<bool>(info[0]).FromJust());
+}
+
+NAN_METHOD(UTPContext::SetReadPool) {
+	Nan::HandleScope scope;
+	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
+	// chunks already opened keep the mode they were opened with
+	utpctx->readPool = Nan::To<bool>(info[0]).FromJust();
+}
+
 NAN_METHOD(UTPContext::jsUnref) {
 	Nan::HandleScope scope;
 	UTPContext *utpctx = Nan::ObjectWrap::Unwrap<UTPContext>(info.Holder());
@@ -0,0 +1,107 @@
+#include "utp.h"
+
+namespace nodeUTP {
+
+vector<ReadPool::Block *> ReadPool::freeBlocks;
+unordered_map<char *, ReadPool::Slice *> ReadPool::slices;
+size_t ReadPool::totalBlocks = 0;
+
+ReadPool::Block *ReadPool::acquire() {
+	Block *block;
+	if (!freeBlocks.empty()) {
+		block = freeBlocks.back();
+		freeBlocks.pop_back();
+	} else {
+		block = new Block;
+		block->data = static_cast<char *>(malloc(BLOCK_SIZE));
+		assert(block->data);
+		block->pins = 0;
+		totalBlocks++;
+	}
+	block->used = 0;
+	block->refs = 1; // the context filling it
+	block->dead = false;
+	return block;
+}
+
+void ReadPool::unref(Block *block) {
+	assert(block->refs > 0);
+	if (--block->refs > 0) return;
+	if (freeBlocks.size() < MAX_FREE_BLOCKS) {
+		// released slices that are still reachable may see new data, as documented
+		freeBlocks.push_back(block);
+	} else if (block->pins == 0) {
+		free(block->data);
+		delete block;
+		totalBlocks--;
+	} else {
+		// freed once the last buffer pointing into it is collected
+		block->dead = true;
+	}
+}
+
+ReadPool::Slice *ReadPool::slice(Block *block, char *data) {
+	Slice *slice = new Slice;
+	slice->block = block;
+	slice->released = false;
+	block->refs++;
+	block->pins++;
+	slices[data] = slice;
+	return slice;
+}
+
+v8::Local<v8::Object> ReadPool::wrap(char *data, size_t len, Slice *slice) {
+	Nan::EscapableHandleScope scope;
+	return scope.Escape(Nan::NewBuffer(data, len, onFree, slice).ToLocalChecked());
+}
+
+bool ReadPool::release(char *data) {
+	auto it = slices.find(data);
+	if (it == slices.end()) return false;
+	Slice *slice = it->second;
+	slices.erase(it);
+	assert(!slice->released);
+	slice->released = true;
+	unref(slice->block);
+	return true;
+}
+
+void ReadPool::onFree(char *data, void *hint) {
+	Slice *slice = static_cast<Slice *>(hint);
+	Block *block = slice->block;
+	if (!slice->released) {
+		// a recycled block may have put a newer slice at the same address
+		auto it = slices.find(data);
+		if (it != slices.end() && it->second == slice) slices.erase(it);
+		unref(block);
+	}
+	delete slice;
+	assert(block->pins > 0);
+	if (--block->pins == 0 && block->dead) {
+		free(block->data);
+		delete block;
+		totalBlocks--;
+	}
+}
+
+NAN_METHOD(ReadPool::Release) {
+	Nan::HandleScope scope;
+	if (!node::Buffer::HasInstance(info[0])) {
+		info.GetReturnValue().Set(Nan::False());
+		return;
+	}
+	char *data = node::Buffer::Data(info[0]);
+	info.GetReturnValue().Set(Nan::New(release(data)));
+}
+
+NAN_METHOD(ReadPool::Stats) {
+	Nan::HandleScope scope;
+	v8::Local<v8::Object> res = Nan::New<v8::Object>();
+	Nan::Set(res, Nan::New("blockSize").ToLocalChecked(), Nan::New<v8::Number>(BLOCK_SIZE));
+	Nan::Set(res, Nan::New("blocks").ToLocalChecked(), Nan::New<v8::Number>(totalBlocks));
+	Nan::Set(res, Nan::New("freeBlocks").ToLocalChecked(), Nan::New<v8::Number>(freeBlocks.size()));
+	Nan::Set(res, Nan::New("liveSlices").ToLocalChecked(), Nan::New<v8::Number>(slices.size()));
+	info.GetReturnValue().Set(res);
+}
+
+}
@@ -4,28 +4,96 @@ namespace nodeUTP {
 
 unordered_set<utp_socket *> UTPSocket::activeSockets;
 Nan::Persistent<v8::Function> UTPSocket::constructor;
+uint32_t UTPSocket::nextId = 1;
+vector<UTPSocket *> UTPSocket::pool;
+uint64_t UTPSocket::created = 0;
+uint64_t UTPSocket::reused = 0;
 
-UTPSocket::UTPSocket(UTPContext *_utpctx, utp_socket *_sock):
-utpctx(_utpctx),
-sock(_sock),
+UTPSocket::UTPSocket():
+utpctx(nullptr),
+id(0),
+sock(nullptr),
 chunkLength(0),
 chunkOffset(0),
 connected(false),
-paused(false),
-readBuf(nullptr),
 readLen(0),
+readChunk(nullptr),
+readChunkLength(0),
+readChunkCapacity(0),
+readChunkLimit(0),
+readChunkIndex(0),
+readBlock(nullptr),
+readChunkPooled(false),
+readIntoData(nullptr),
+readIntoLength(0),
+readIntoFilled(0),
+readIntoEvent(0),
+readIntoQueued(false),
+readIntoHeld(false),
+readSpillOffset(0),
+telemetryRow(-1),
 refSelf(false)
 {
-	utp_set_userdata(sock, this);
-	activeSockets.insert(sock);
 	Nan::HandleScope scope;
 	v8::Local<v8::Object> sockObj = Nan::New(constructor)->NewInstance(0, 0);
 	Wrap(sockObj);
-	uvRef();
 	Ref();
 }
 
+UTPSocket *UTPSocket::create(UTPContext *utpctx, utp_socket *sock) {
+	UTPSocket *utpsock;
+	if (!pool.empty()) {
+		utpsock = pool.back();
+		pool.pop_back();
+		reused++;
+	} else {
+		utpsock = new UTPSocket();
+		created++;
+	}
+	utpsock->attach(utpctx, sock);
+	return utpsock;
+}
+
+void UTPSocket::attach(UTPContext *_utpctx, utp_socket *_sock) {
+	utpctx = _utpctx;
+	sock = _sock;
+	// a fresh id, events still in flight for the previous owner are dropped
+	id = nextId++;
+	utp_set_userdata(sock, this);
+	activeSockets.insert(sock);
+	Nan::HandleScope scope;
+	Nan::Set(handle(), Nan::New("_id").ToLocalChecked(), Nan::New<v8::Uint32>(id));
+	utp_socket_telemetry *row = utpctx->acquireTelemetryRow(&telemetryRow);
+	if (row) {
+		row->id = id;
+		utp_set_telemetry(sock, row);
+	}
+	uvRef();
+}
+
+void UTPSocket::reset() {
+	utpctx = nullptr;
+	sock = nullptr;
+	chunk.reset(nullptr);
+	chunkLength = chunkOffset = 0;
+	connected = false;
+	readLen = 0;
+	assert(!readChunk && !readBlock);
+	readChunkLength = readChunkCapacity = readChunkLimit = 0;
+	readChunkPooled = false;
+	readIntoBuffer.Reset();
+	readIntoData = nullptr;
+	readIntoLength = readIntoFilled = 0;
+	readIntoQueued = readIntoHeld = false;
+	vector<char>().swap(readSpill);
+	readSpillOffset = 0;
+	assert(telemetryRow < 0);
+}
+
 UTPSocket::~UTPSocket() {
+	if (!readChunkPooled) free(readChunk);
+	if (readBlock) ReadPool::unref(readBlock);
+	readIntoBuffer.Reset();
 }
 
 void UTPSocket::uvRef() {
@@ -51,8 +119,15 @@ void UTPSocket::Init(v8::Local<v8::Object> exports, v8::Local<v8::Object> module
 	Nan::SetPrototypeMethod(tpl, "close", Close);
 	Nan::SetPrototypeMethod(tpl, "forceTimedOut", ForceTimedOut);
 	Nan::SetPrototypeMethod(tpl, "remoteAddress", RemoteAddress);
+	Nan::SetPrototypeMethod(tpl, "getStats", GetStats);
+	Nan::SetPrototypeMethod(tpl, "telemetryRow", TelemetryRow);
+	Nan::SetPrototypeMethod(tpl, "getLatency", GetLatency);
 	Nan::SetPrototypeMethod(tpl, "slow", SlowSpeed);
 	Nan::SetPrototypeMethod(tpl, "normal", NormalSpeed);
+	Nan::SetPrototypeMethod(tpl, "readDrained", ReadDrained);
+	Nan::SetPrototypeMethod(tpl, "setReadInto", SetReadInto);
+	Nan::SetPrototypeMethod(tpl, "readIntoDone", ReadIntoDone);
+	Nan::SetPrototypeMethod(tpl, "spillReadInto", SpillReadInto);
 	Nan::SetPrototypeMethod(tpl, "ref", jsRef);
 	Nan::SetPrototypeMethod(tpl, "unref", jsUnref);
 
@@ -69,13 +144,12 @@ NAN_METHOD(UTPSocket::New) {
 NAN_METHOD(UTPSocket::Write) {
 	Nan::HandleScope scope;
 	v8::Local<v8::Object> buf = info[0].As<v8::Object>();
-	v8::Local<v8::Function> cb = info[1].As<v8::Function>();
 	UTPSocket *utpsock = get(info.Holder());
 	const char *chunk = node::Buffer::Data(buf);
 	size_t len = node::Buffer::Length(buf);
 	unique_ptr<char[]> newchunk(new char[len]);
 	std::copy(chunk, chunk + len, newchunk.get());
-	utpsock->setChunk(std::move(newchunk), len, cb);
+	utpsock->setChunk(std::move(newchunk), len);
 	utpsock->write();
 }
 
@@ -104,6 +178,128 @@ NAN_METHOD(UTPSocket::NormalSpeed) {
 	utp_setsockopt(utpsock->sock, UTP_RCVBUF, 1048576);
 }
 
+NAN_METHOD(UTPSocket::ReadDrained) {
+	Nan::HandleScope scope;
+	UTPSocket *utpsock = get(info.Holder());
+	// the readable stream reports how much it still buffers
+	utpsock->readLen = Nan::To<v8::Uint32>(info[0]).ToLocalChecked()->Value();
+	if (activeSockets.find(utpsock->sock) == activeSockets.end()) return;
+	utp_read_drained(utpsock->sock);
+	// send the window update now instead of waiting for the next packet
+	utp_issue_deferred_acks(utp_get_context(utpsock->sock));
+}
+
+NAN_METHOD(UTPSocket::SetReadInto) {
+	Nan::HandleScope scope;
+	UTPSocket *utpsock = get(info.Holder());
+	v8::Local<v8::Object> buf = info[0].As<v8::Object>();
+	assert(!utpsock->readIntoData);
+	assert(node::Buffer::Length(buf) > 0);
+	utpsock->readIntoBuffer.Reset(buf);
+	utpsock->readIntoData = node::Buffer::Data(buf);
+	utpsock->readIntoLength = node::Buffer::Length(buf);
+}
+
+/*
+ * Called once the onread callback returned and the buffer may be reused.
+ * Refills it from bytes that arrived in the meantime and returns their
+ * count, so js can loop until everything received so far is consumed.
+ */
+NAN_METHOD(UTPSocket::ReadIntoDone) {
+	Nan::HandleScope scope;
+	UTPSocket *utpsock = get(info.Holder());
+	assert(utpsock->readIntoHeld);
+	size_t n = std::min(utpsock->readSpill.size() - utpsock->readSpillOffset, utpsock->readIntoLength);
+	memcpy(utpsock->readIntoData, utpsock->readSpill.data() + utpsock->readSpillOffset, n);
+	utpsock->readSpillOffset += n;
+	if (utpsock->readSpillOffset == utpsock->readSpill.size()) {
+		// keeps its capacity, so a steady stream allocates nothing
+		utpsock->readSpill.clear();
+		utpsock->readSpillOffset = 0;
+	}
+	utpsock->readIntoFilled = n;
+	utpsock->readIntoHeld = n > 0;
+	info.GetReturnValue().Set(Nan::New<v8::Uint32>(static_cast<uint32_t>(n)));
+	if (activeSockets.find(utpsock->sock) == activeSockets.end()) return;
+	// the window only opens by what the callback actually consumed
+	utp_read_drained(utpsock->sock);
+	utp_issue_deferred_acks(utp_get_context(utpsock->sock));
+}
+
+/*
+ * Queues a chunk that was read before setReadInto() (an accepted socket can
+ * receive data first) behind the buffer, so js takes it through
+ * readIntoDone() and the pause on a false return like any later bytes.
+ */
+NAN_METHOD(UTPSocket::SpillReadInto) {
+	Nan::HandleScope scope;
+	UTPSocket *utpsock = get(info.Holder());
+	v8::Local<v8::Object> buf = info[0].As<v8::Object>();
+	assert(utpsock->readIntoData);
+	// events only go out once the buffer's fill is sealed
+	assert(!utpsock->readIntoQueued);
+	const char *data = node::Buffer::Data(buf);
+	utpsock->readSpill.insert(utpsock->readSpill.end(), data, data + node::Buffer::Length(buf));
+	utpsock->readIntoHeld = true;
+}
+
+/*
+ * Copies the socket's counters into a Float64Array of STAT_COUNT slots, so
+ * polling them allocates nothing. Returns false once the socket is gone and
+ * leaves the array as it was.
+ */
+NAN_METHOD(UTPSocket::GetStats) {
+	Nan::HandleScope scope;
+	UTPSocket *utpsock = get(info.Holder());
+	if (activeSockets.find(utpsock->sock) == activeSockets.end()) {
+		info.GetReturnValue().Set(Nan::False());
+		return;
+	}
+	Nan::TypedArrayContents<double> out(info[0]);
+	assert(out.length() >= STAT_COUNT);
+	utp_socket_stats *stats = utp_get_stats(utpsock->sock);
+	assert(stats);
+	double *v = *out;
+	v[STAT_BYTES_RECEIVED] = stats->nbytes_recv;
+	v[STAT_BYTES_SENT] = stats->nbytes_xmit;
+	v[STAT_PACKETS_RECEIVED] = stats->nrecv;
+	v[STAT_PACKETS_SENT] = stats->nxmit;
+	v[STAT_RETRANSMITS] = stats->rexmit;
+	v[STAT_FAST_RETRANSMITS] = stats->fastrexmit;
+	v[STAT_DUPLICATES] = stats->nduprecv;
+	v[STAT_RTT] = stats->rtt;
+	v[STAT_RTT_VAR] = stats->rtt_var;
+	v[STAT_RTO] = stats->rto;
+	v[STAT_MAX_WINDOW] = stats->max_window;
+	v[STAT_CUR_WINDOW] = stats->cur_window;
+	v[STAT_MTU] = stats->mtu_guess;
+	v[STAT_DELAY] = stats->delay;
+	info.GetReturnValue().Set(Nan::True());
+}
+
+NAN_METHOD(UTPSocket::GetLatency) {
+	Nan::HandleScope scope;
+	UTPSocket *utpsock = get(info.Holder());
+	if (activeSockets.find(utpsock->sock) == activeSockets.end()) {
+		info.GetReturnValue().Set(Nan::Null());
+		return;
+	}
+	utp_histogram *rtt = utp_get_histogram(utpsock->sock, UTP_HISTOGRAM_RTT);
+	utp_histogram *delay = utp_get_histogram(utpsock->sock, UTP_HISTOGRAM_DELAY);
+	// the context keeps no histograms per socket
+	if (!rtt || !delay) {
+		info.GetReturnValue().Set(Nan::Null());
+		return;
+	}
+	info.GetReturnValue().Set(UTPContext::latencyObject(rtt, delay, info[0]));
+}
+
+NAN_METHOD(UTPSocket::TelemetryRow) {
+	Nan::HandleScope scope;
+	UTPSocket *utpsock = get(info.Holder());
+	info.GetReturnValue().Set(Nan::New<v8::Int32>(utpsock->telemetryRow));
+}
+
 NAN_METHOD(UTPSocket::RemoteAddress) {
 	Nan::HandleScope scope;
 	UTPSocket *utpsock = Nan::ObjectWrap::Unwrap<UTPSocket>(info.Holder());
@@ -154,6 +350,15 @@ NAN_METHOD(UTPSocket::jsUnref) {
 	utpsock->uvUnref();
 }
 
+NAN_METHOD(UTPSocket::PoolStats) {
+	Nan::HandleScope scope;
+	v8::Local<v8::Object> res = Nan::New<v8::Object>();
+	Nan::Set(res, Nan::New("pooled").ToLocalChecked(), Nan::New<v8::Number>(pool.size()));
+	Nan::Set(res, Nan::New("created").ToLocalChecked(), Nan::New<v8::Number>(created));
+	Nan::Set(res, Nan::New("reused").ToLocalChecked(), Nan::New<v8::Number>(reused));
+	info.GetReturnValue().Set(res);
+}
+
 NAN_METHOD(UTPSocket::CleanUp) {
 	for (auto sock: activeSockets) {
 		utp_close(sock);
@@ -161,12 +366,11 @@ NAN_METHOD(UTPSocket::CleanUp) {
 	activeSockets.empty();
 }
 
-void UTPSocket::setChunk(unique_ptr<char[]>&& _chunk, size_t len, v8::Local<v8::Function> cb) {
+void UTPSocket::setChunk(unique_ptr<char[]>&& _chunk, size_t len) {
 	assert(!chunk.get());
 	chunk = std::move(_chunk);
 	chunkLength = len;
 	chunkOffset = 0;
-	writeCb.SetFunction(cb);
 }
 
 void UTPSocket::write() {
@@ -179,25 +383,104 @@ void UTPSocket::write() {
 		if (sent == 0) break;
 	}
 	if (chunkOffset == chunkLength) {
-		Nan::HandleScope scope;
 		chunkOffset = chunkLength = 0;
 		chunk.reset(nullptr);
-		writeCb.Call(0, 0);
+		utpctx->queueEvent(this, EVENT_WRITE);
 	}
 }
 
 void UTPSocket::onConnect() {
-	Nan::HandleScope scope;
 	connected = true;
-	Nan::Callback(handle()->Get(Nan::New("_onConnect").ToLocalChecked()).As<v8::Function>()).Call(0, 0);
+	utpctx->queueEvent(this, EVENT_CONNECT);
 	write();
 }
 
 void UTPSocket::onRead(const void *_buf, size_t len) {
-	Nan::HandleScope scope;
-	utp_read_drained(sock);
-	v8::Local<v8::Value> argv[] = { Nan::CopyBuffer(static_cast<const char *>(_buf), len).ToLocalChecked() };
-	Nan::Callback(handle()->Get(Nan::New("_onRead").ToLocalChecked()).As<v8::Function>()).Call(1, argv);
+	const char *buf = static_cast<const char *>(_buf);
+	size_t limit = utpctx->readCoalesceSize();
+	readLen += len;
+	if (readIntoData) {
+		readInto(buf, len);
+		return;
+	}
+	while (len > 0) {
+		if (!readChunk) {
+			openRead(len, limit);
+		} else if (readChunkLength >= readChunkLimit ||
+				(readChunkPooled && readChunk + readChunkLength != readBlock->data + readBlock->used)) {
+			// full, or another socket's chunk was cut from the block after it
+			sealRead();
+			continue;
+		}
+		size_t n = std::min(len, readChunkLimit - readChunkLength);
+		if (readChunkLength + n > readChunkCapacity) {
+			// only malloc'ed chunks grow, pooled ones are sized up front
+			size_t capacity = std::min(std::max(readChunkCapacity * 2, readChunkLength + n), readChunkLimit);
+			char *newChunk = static_cast<char *>(realloc(readChunk, capacity));
+			assert(newChunk);
+			readChunk = newChunk;
+			readChunkCapacity = capacity;
+		}
+		memcpy(readChunk + readChunkLength, buf, n);
+		readChunkLength += n;
+		if (readChunkPooled) readBlock->used += n;
+		buf += n;
+		len -= n;
+	}
+}
+
+void UTPSocket::readInto(const char *buf, size_t len) {
+	if (!readIntoHeld) {
+		size_t n = std::min(len, readIntoLength - readIntoFilled);
+		if (n > 0 && !readIntoQueued) {
+			readIntoEvent = utpctx->queueReadInto(this);
+			readIntoQueued = true;
+		}
+		memcpy(readIntoData + readIntoFilled, buf, n);
+		readIntoFilled += n;
+		buf += n;
+		len -= n;
+	}
+	readSpill.insert(readSpill.end(), buf, buf + len);
+}
+
+void UTPSocket::openRead(size_t len, size_t limit) {
+	readChunkIndex = utpctx->queueRead(this);
+	readChunkLength = 0;
+	readChunkPooled = utpctx->readPoolEnabled();
+	if (readChunkPooled) {
+		// the chunk starts where the context's last one ended
+		readBlock = utpctx->fillBlock();
+		readBlock->refs++;
+		readChunk = readBlock->data + readBlock->used;
+		readChunkLimit = readChunkCapacity = std::min(limit, ReadPool::BLOCK_SIZE - readBlock->used);
+	} else {
+		readChunkLimit = limit;
+		readChunkCapacity = std::min(std::max<size_t>(len, 4096), limit);
+		readChunk = static_cast<char *>(malloc(readChunkCapacity));
+		assert(readChunk);
+	}
+}
+
+void UTPSocket::sealRead() {
+	if (readIntoQueued) {
+		utpctx->setEventArg(readIntoEvent, readIntoFilled);
+		readIntoQueued = false;
+		readIntoHeld = true;
+		return;
+	}
+	if (!readChunk) return;
+	ReadPool::Slice *slice = nullptr;
+	if (readChunkPooled) {
+		// from here on only the slice keeps the block
+		slice = ReadPool::slice(readBlock, readChunk);
+		ReadPool::unref(readBlock);
+		readBlock = nullptr;
+	}
+	utpctx->setReadChunk(readChunkIndex, readChunk, readChunkLength, slice);
+	readChunk = nullptr;
+	readChunkLength = readChunkCapacity = readChunkLimit = 0;
+	readChunkPooled = false;
 }
 
 void UTPSocket::onWritable() {
@@ -209,31 +492,11 @@ void UTPSocket::onEnd() {
 		utp_close(sock);
 		activeSockets.erase(sock);
 	}
-	Nan::HandleScope scope;
-	Nan::Callback(handle()->Get(Nan::New("_onEnd").ToLocalChecked()).As<v8::Function>()).Call(0, 0);
+	utpctx->queueEvent(this, EVENT_END);
 }
 
 void UTPSocket::onError(int errcode) {
-	Nan::HandleScope scope;
-	const char *errstr = "unknown error", *errname = "UNKNOWN";
-	switch (errcode) {
-	case UTP_ECONNREFUSED:
-		errstr = "connection refused";
-		errname = "ECONNREFUSED";
-		break;
-	case UTP_ECONNRESET:
-		errstr = "connection reset by peer";
-		errname = "ECONNRESET";
-		break;
-	case UTP_ETIMEDOUT:
-		errstr = "connection timed out";
-		errname = "ETIMEDOUT";
-		break;
-	}
-	v8::Local<v8::Value> err = Nan::Error(errstr);
-	Nan::To<v8::Object>(err).ToLocalChecked()->Set(Nan::New("code").ToLocalChecked(), Nan::New(errname).ToLocalChecked());
-	v8::Local<v8::Value> argv[] = {err};
-	Nan::Callback(handle()->Get(Nan::New("_onError").ToLocalChecked()).As<v8::Function>()).Call(1, argv);
+	utpctx->queueEvent(this, EVENT_ERROR, errcode);
 	if (activeSockets.find(sock) != activeSockets.end()) {
 		utp_close(sock);
 		activeSockets.erase(sock);
@@ -242,14 +505,31 @@ void UTPSocket::onError(int errcode) {
 
 void UTPSocket::onDestroy() {
 	if (!sock) return;
-	Nan::HandleScope scope;
-	Nan::Callback(handle()->Get(Nan::New("_onDestroy").ToLocalChecked()).As<v8::Function>()).Call(0, 0);
 	if (chunk.get()) {
-		v8::Local<v8::Value> argv[] = {Nan::Error("This socket is closed.")};
-		writeCb.Call(1, argv);
+		chunk.reset(nullptr);
+		utpctx->queueEvent(this, EVENT_WRITE, 1);
+	}
+	utpctx->queueEvent(this, EVENT_DESTROY);
+	if (telemetryRow >= 0) {
+		utp_set_telemetry(sock, nullptr);
+		utpctx->releaseTelemetryRow(telemetryRow);
+		telemetryRow = -1;
 	}
 	sock = nullptr;
+	// keep the handle alive until js has seen the destroy event
+	utpctx->releaseSocket(this);
+}
+
+void UTPSocket::release() {
+	// every chunk was sealed by the flush
+	assert(!readBlock);
 	uvUnref();
+	if (pool.size() < MAX_POOLED) {
+		// keep the wrapper and its handle strong for the next connection
+		reset();
+		pool.push_back(this);
+		return;
+	}
 	Unref();
 	MakeWeak();
 }
@@ -0,0 +1,86 @@
+#include "utp.h"
+
+namespace nodeUTP {
+
+uv_timer_t TimerService::timer;
+bool TimerService::initialized = false;
+multimap<uint64_t, UTPContext *> TimerService::deadlines;
+unordered_map<UTPContext *, multimap<uint64_t, UTPContext *>::iterator> TimerService::scheduled;
+uint64_t TimerService::wakeups = 0;
+uint64_t TimerService::idleWakeups = 0;
+uint64_t TimerService::checks = 0;
+
+void TimerService::schedule(UTPContext *utpctx, uint64_t delay) {
+	if (!initialized) {
+		int assertionResult;
+		assertionResult = uv_timer_init(uv_default_loop(), &timer);
+		assert(assertionResult >= 0);
+		// sockets keep the loop alive through their udp handle
+		uv_unref(reinterpret_cast<uv_handle_t *>(&timer));
+		initialized = true;
+	}
+	uint64_t deadline = uv_now(uv_default_loop()) + delay;
+	auto it = scheduled.find(utpctx);
+	if (it != scheduled.end()) {
+		// an earlier deadline wins
+		if (it->second->first <= deadline) return;
+		deadlines.erase(it->second);
+	}
+	scheduled[utpctx] = deadlines.insert(std::make_pair(deadline, utpctx));
+	arm();
+}
+
+void TimerService::cancel(UTPContext *utpctx) {
+	auto it = scheduled.find(utpctx);
+	if (it == scheduled.end()) return;
+	deadlines.erase(it->second);
+	scheduled.erase(it);
+	arm();
+}
+
+void TimerService::arm() {
+	int assertionResult;
+	if (deadlines.empty()) {
+		assertionResult = uv_timer_stop(&timer);
+		assert(assertionResult >= 0);
+		return;
+	}
+	uint64_t now = uv_now(uv_default_loop());
+	uint64_t first = deadlines.begin()->first;
+	assertionResult = uv_timer_start(&timer, onTimer, first > now ? first - now : 0, 0);
+	assert(assertionResult >= 0);
+}
+
+void TimerService::onTimer(uv_timer_t *handle) {
+	uint64_t now = uv_now(uv_default_loop());
+	vector<UTPContext *> due;
+	while (!deadlines.empty() && deadlines.begin()->first <= now) {
+		due.push_back(deadlines.begin()->second);
+		scheduled.erase(deadlines.begin()->second);
+		deadlines.erase(deadlines.begin());
+	}
+	wakeups++;
+	bool busy = false;
+	for (UTPContext *utpctx: due) {
+		checks++;
+		// a context that lost its last connection simply drops out
+		if (utpctx->checkTimeouts()) {
+			busy = true;
+			schedule(utpctx, UTPContext::TIMEOUT_INTERVAL);
+		}
+	}
+	if (!busy) idleWakeups++;
+	arm();
+}
+
+NAN_METHOD(TimerService::Stats) {
+	Nan::HandleScope scope;
+	v8::Local<v8::Object> res = Nan::New<v8::Object>();
+	Nan::Set(res, Nan::New("contexts").ToLocalChecked(), Nan::New<v8::Number>(scheduled.size()));
+	Nan::Set(res, Nan::New("wakeups").ToLocalChecked(), Nan::New<v8::Number>(wakeups));
+	Nan::Set(res, Nan::New("idleWakeups").ToLocalChecked(), Nan::New<v8::Number>(idleWakeups));
+	Nan::Set(res, Nan::New("checks").ToLocalChecked(), Nan::New<v8::Number>(checks));
+	info.GetReturnValue().Set(res);
+}
+
+}